@@ -0,0 +1,249 @@
+// INSANELY WAVY TSUNAMI PANIC
+// ---------------------------
+// Baked file formats, shared by the game and work/asset_bake. Framework free, plain POD records.
+// All offsets are in bytes from the start of the file, all strings are NUL-terminated in the string blob.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* BAKED SCENE (.bscn) */
+
+// header | node[node_count] | object[object_count] | light[light_count] | camera[camera_count] |
+// material_alias[material_alias_count] | strings
+namespace baked_scene {
+
+static const uint32_t magic = 0x4e435342; // 'BSCN'
+static const uint32_t version = 3;
+
+enum component_field : uint32_t {
+	LightShadowMap = 0x01,
+	LightShadowRange = 0x02,
+	LightDiffuseColor = 0x04,
+	LightSpecularColor = 0x08,
+	LightDiffuseIntensity = 0x10,
+
+	CameraOrthographic = 0x01,
+
+	EnvironmentAmbientColor = 0x01,
+	EnvironmentFogColor = 0x02,
+};
+
+struct header {
+	uint32_t magic, version;
+
+	uint32_t node_count, node_offset;
+	uint32_t object_count, object_offset;
+	uint32_t light_count, light_offset;
+	uint32_t camera_count, camera_offset;
+	uint32_t material_alias_count, material_alias_offset;
+	uint32_t string_size, string_offset;
+
+	uint32_t environment_fields;
+	float ambient_color[3], fog_color[3];
+};
+
+static const int32_t no_component = -1;
+
+struct node {
+	uint32_t uid, name; // name is a string blob offset
+	float position[3], rotation[3], scale[3];
+	int32_t object, light, camera; // component record index or no_component
+};
+
+struct object {
+	uint32_t geometry; // string blob offset
+};
+
+// core::Light::Model order
+enum light_model : uint32_t {
+	LightPoint,
+	LightLinear,
+	LightSpot,
+};
+
+struct light {
+	uint32_t fields;
+	uint32_t model; // light_model
+	float shadow_range;
+	float diffuse_color[3], specular_color[3];
+	float diffuse_intensity;
+};
+
+struct camera {
+	uint32_t fields;
+	float zoom_factor, znear, zfar;
+};
+
+// a material path as referenced from geometry files, resolved to the canonical material with the same content
+struct material_alias {
+	uint32_t alias, canonical; // string blob offsets
+};
+
+} // baked_scene
+
+/* PACKED ARCHIVE (.pak) */
+
+// header | page aligned entry data | index[entry_count] sorted by path hash | strings
+namespace baked_pack {
+
+static const uint32_t magic = 0x4b415054; // 'TPAK'
+static const uint32_t version = 1;
+static const uint32_t page_size = 4096;
+
+enum entry_flag : uint32_t {
+	EntryLZ4 = 0x01, // LZ4 block, packed_size bytes inflate to size bytes
+};
+
+struct header {
+	uint32_t magic, version;
+	uint32_t entry_count, index_offset;
+	uint32_t string_size, string_offset;
+};
+
+struct entry {
+	uint64_t hash; // path_hash of the path
+	uint64_t offset;
+	uint32_t size, packed_size;
+	uint32_t flags, path; // path is a string blob offset
+};
+
+// FNV-1a over the path with '\' folded to '/'
+inline uint64_t path_hash(const char *path) {
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (; *path; ++path) {
+		h ^= uint8_t(*path == '\\' ? '/' : *path);
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+// LZ4 block decoder, returns the number of bytes written or 0 on malformed input
+inline size_t lz4_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+	auto ip = src, ip_end = src + src_size;
+	auto op = dst, op_end = dst + dst_size;
+
+	auto read_length = [&](size_t len) -> size_t {
+		if (len == 15)
+			for (uint8_t b = 255; b == 255 && ip < ip_end;)
+				len += (b = *ip++);
+		return len;
+	};
+
+	while (ip < ip_end) {
+		auto token = *ip++;
+
+		// literals
+		auto literal_len = read_length(token >> 4);
+		if (literal_len > size_t(ip_end - ip) || literal_len > size_t(op_end - op))
+			return 0;
+		for (auto e = ip + literal_len; ip < e;)
+			*op++ = *ip++;
+
+		if (ip == ip_end)
+			break; // last sequence has no match
+
+		// match
+		if (ip_end - ip < 2)
+			return 0;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		auto match_len = read_length(token & 15) + 4;
+		if (!offset || offset > size_t(op - dst) || match_len > size_t(op_end - op))
+			return 0;
+		for (auto m = op - offset, e = op + match_len; op < e;)
+			*op++ = *m++; // byte copy, matches may overlap
+	}
+
+	return op - dst;
+}
+
+} // baked_pack
+
+/* FLOOD LOOP (.loop) */
+
+// header | frame offsets[frame_count + 1] | frames
+// A frame holds the 3 quantized coordinates of every particle in particle id order, each one stored as the zigzag
+// varint of its difference with the previous frame. The first frame is relative to zero, playback wraps back to it.
+namespace baked_flood {
+
+static const uint32_t magic = 0x444f4c46; // 'FLOD'
+static const uint32_t version = 1;
+
+struct header {
+	uint32_t magic, version;
+	uint32_t particle_count, frame_count;
+	uint32_t frame_offset; // frame offsets table
+	float bounds_min[3], bounds_max[3]; // quantization range
+};
+
+inline uint16_t quantize(float v, float mn, float mx) {
+	float t = (v - mn) / (mx - mn);
+	t = t < 0.f ? 0.f : (t > 1.f ? 1.f : t);
+	return uint16_t(t * 65535.f + 0.5f);
+}
+
+inline float dequantize(uint16_t q, float mn, float mx) { return mn + float(q) * (mx - mn) / 65535.f; }
+
+static const size_t max_delta_size = 3; // a 17 bit zigzag value
+
+inline uint8_t *put_delta(uint8_t *out, int32_t d) {
+	uint32_t z = (uint32_t(d) << 1) ^ uint32_t(d >> 31);
+	for (; z >= 0x80; z >>= 7)
+		*out++ = uint8_t(z | 0x80);
+	*out++ = uint8_t(z);
+	return out;
+}
+
+// returns nullptr on truncated input
+inline const uint8_t *get_delta(const uint8_t *in, const uint8_t *end, int32_t &d) {
+	uint32_t z = 0;
+	for (int shift = 0; in < end && shift < 32; shift += 7) {
+		auto b = *in++;
+		z |= uint32_t(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			d = int32_t(z >> 1) ^ -int32_t(z & 1);
+			return in;
+		}
+	}
+	return nullptr;
+}
+
+} // baked_flood
+
+/* TILED HEIGHTMAP (.tiles) */
+
+// header | tile[tiles_x * tiles_z] row major | overview | tile data
+// Heights are quantized over [height_min, height_max]. A tile holds tile_size² samples row major, LZ4 block compressed
+// when flagged. The overview holds the highest sample of each overview_step² block, it answers for tiles which are not
+// resident so water never sinks into the terrain.
+namespace baked_height {
+
+static const uint32_t magic = 0x4c495448; // 'HTIL'
+static const uint32_t version = 1;
+
+enum tile_flag : uint32_t {
+	TileLZ4 = 0x01,
+};
+
+struct header {
+	uint32_t magic, version;
+	uint32_t width, height; // in samples, multiples of tile_size
+	uint32_t tile_size, tiles_x, tiles_z;
+	uint32_t overview_step, overview_offset; // (width / overview_step) * (height / overview_step) samples
+	uint32_t tile_offset;
+	float height_min, height_max;
+};
+
+struct tile {
+	uint32_t offset;
+	uint32_t size, packed_size; // in bytes
+	uint32_t flags;
+};
+
+using baked_flood::quantize;
+using baked_flood::dequantize;
+
+} // baked_height
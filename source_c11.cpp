@@ -1,13 +1,32 @@
 #include <vector>
 #include <array>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define WAVY_SSE
+#include <xmmintrin.h>
+#endif
 
 #include "plus/plus.h"
 
 #include "scene/components/camera.h"
+#include "scene/components/environment.h"
 #include "scene/components/light.h"
+#include "scene/components/object.h"
 #include "scene/components/simple_graphic_scene_overlay.h"
 #include "scene/components/transform.h"
-#include "scene/scene_picking.h"
 #include "scene/systems/renderable_system.h"
 #include "scene_serialization/scene_serialization.h"
 #include "scene_serialization/scene_serialization_context.h"
@@ -24,30 +43,666 @@
 #include "io_core_drivers/io_cfile.h"
 #include "io_zip/io_zip.h"
 
+#include "bake_formats.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace gs;
 
-/* PARTICLE FIELD */
+/* FRAME MEMORY */
+
+// Linear arena for transient per-frame scratch (simulation, splatting, meshing), reset once the frame is flipped or the
+// simulation stepped.
+// Allocations are never released individually.
+struct frame_arena {
+	explicit frame_arena(size_t size) : storage(size) {}
+
+	void *alloc(size_t size, size_t align = 16) {
+		auto offset = (cursor + align - 1) & ~(align - 1);
+		__RASSERT_MSG__(offset + size <= storage.size(), "Frame arena exhausted");
+		cursor = offset + size;
+		peak = std::max(peak, cursor);
+		return storage.data() + offset;
+	}
+
+	template <typename T> T *alloc_array(size_t count) { return reinterpret_cast<T *>(alloc(count * sizeof(T), alignof(T))); }
+
+	void reset() { cursor = 0; }
+
+	std::vector<uint8_t> storage;
+	size_t cursor = 0, peak = 0;
+};
+
+// Each thread that allocates scratch owns an arena and binds it on start: the render thread binds render_scratch in
+// main and resets it after each flip, the simulation thread binds sim_scratch and resets it every step. Worker
+// threads have none, jobs get their scratch from the dispatching thread.
+frame_arena render_scratch(8 * 1024 * 1024), sim_scratch(1024 * 1024);
+thread_local frame_arena *scratch = nullptr;
+
+#ifdef _DEBUG
+// every global heap allocation is counted and shown in the debug window, frames are not free of them: the engine
+// polygoniser grows the water iso surfaces and the engine allocates internally
+std::atomic<uint32_t> heap_allocation_count(0);
+
+void *operator new(size_t size) {
+	++heap_allocation_count;
+	if (auto p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+#endif
+
+/* PARALLEL */
+
+// Persistent workers for data parallel loops, the calling thread takes part in the work. Jobs are passed by pointer
+// so dispatching a loop does not allocate.
+struct worker_pool {
+	~worker_pool() { stop(); }
+
+	void start(int count) {
+		for (int i = 0; i < count; ++i)
+			threads.emplace_back([this] { run(); });
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+
+		for (auto &t : threads)
+			t.join();
+		threads.clear();
+	}
+
+	int size() const { return int(threads.size()) + 1; }
+
+	// call fn(begin, end) over [begin, end) in chunks of grain items
+	template <typename F> void parallel_for(int begin, int end, int grain, F &&fn) {
+		if (threads.empty() || end - begin <= grain) {
+			if (begin < end)
+				fn(begin, end);
+			return;
+		}
+
+		std::lock_guard<std::mutex> dispatch_lock(dispatch); // the render and simulation threads share the pool
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job_fn = &invoke<typename std::remove_reference<F>::type>;
+			job_ctx = &fn;
+			job_end = end;
+			job_grain = grain;
+			job_next = begin;
+			pending = int(threads.size());
+			++generation;
+		}
+		wake.notify_all();
+
+		work();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return pending == 0; });
+	}
+
+private:
+	template <typename F> static void invoke(void *ctx, int begin, int end) { (*static_cast<F *>(ctx))(begin, end); }
+
+	void work() {
+		for (;;) {
+			int begin = job_next.fetch_add(job_grain);
+			if (begin >= job_end)
+				break;
+			job_fn(job_ctx, begin, std::min(begin + job_grain, job_end));
+		}
+	}
+
+	void run() {
+		uint64_t seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || generation != seen; });
+				if (quit)
+					return;
+				seen = generation;
+			}
+
+			work();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::mutex mutex, dispatch;
+	std::condition_variable wake, done;
+	bool quit = false;
+
+	uint64_t generation = 0;
+	int pending = 0;
+
+	void (*job_fn)(void *, int, int) = nullptr;
+	void *job_ctx = nullptr;
+	int job_end = 0, job_grain = 1;
+	std::atomic<int> job_next;
+};
+
+worker_pool workers;
+
+// Stable LSD radix sort of 32 bit keys carrying 32 bit values, over the low key_bits bits. Each pass counts digits per
+// chunk in parallel, offsets are laid out digit major then chunk major and chunks scatter in parallel, which keeps
+// equal keys in input order. The sorted pairs end up in keys/values, tmp_keys/tmp_values are scratch of count items.
+void radix_sort(uint32_t *keys, uint32_t *values, uint32_t *tmp_keys, uint32_t *tmp_values, int count, int key_bits) {
+	static const int digit_bits = 8, digit_count = 1 << digit_bits, grain = 2048;
+	const int chunk_count = (count + grain - 1) / grain;
+
+	auto histograms = scratch->alloc_array<uint32_t>(chunk_count * digit_count);
+
+	for (int shift = 0; shift < key_bits; shift += digit_bits) {
+		std::fill(histograms, histograms + chunk_count * digit_count, 0);
+
+		workers.parallel_for(0, count, grain, [&](int begin, int end) {
+			for (int c = begin; c < end; c += grain) {
+				auto histogram = histograms + (c / grain) * digit_count;
+				for (int i = c, e = std::min(c + grain, end); i < e; ++i)
+					++histogram[(keys[i] >> shift) & (digit_count - 1)];
+			}
+		});
+
+		uint32_t offset = 0;
+		for (int d = 0; d < digit_count; ++d)
+			for (int c = 0; c < chunk_count; ++c) {
+				auto n = histograms[c * digit_count + d];
+				histograms[c * digit_count + d] = offset;
+				offset += n;
+			}
+
+		workers.parallel_for(0, count, grain, [&](int begin, int end) {
+			for (int c = begin; c < end; c += grain) {
+				auto histogram = histograms + (c / grain) * digit_count;
+				for (int i = c, e = std::min(c + grain, end); i < e; ++i) {
+					auto o = histogram[(keys[i] >> shift) & (digit_count - 1)]++;
+					tmp_keys[o] = keys[i];
+					tmp_values[o] = values[i];
+				}
+			}
+		});
+
+		std::swap(keys, tmp_keys);
+		std::swap(values, tmp_values);
+	}
+
+	if (((key_bits + digit_bits - 1) / digit_bits) & 1) { // odd pass count, results are in the caller's scratch
+		std::copy(keys, keys + count, tmp_keys);
+		std::copy(values, values + count, tmp_values);
+	}
+}
+
+/* MAPPED FILES */
+
+// Read-only mapping of a whole file.
+struct mapped_file {
+	mapped_file() = default;
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+	~mapped_file() { unmap(); }
+
+	bool map(const char *path) {
+		unmap();
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		mapping_size = size_t(file_size.QuadPart);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+			base = reinterpret_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		auto fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (!fstat(fd, &st)) {
+			mapping_size = size_t(st.st_size);
+			auto p = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+				base = reinterpret_cast<const uint8_t *>(p);
+		}
+		close(fd);
+#endif
+		if (!base)
+			unmap();
+		return base != nullptr;
+	}
+
+	void unmap() {
+#ifdef _WIN32
+		if (base)
+			UnmapViewOfFile(base);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (base)
+			munmap(const_cast<uint8_t *>(base), mapping_size);
+#endif
+		base = nullptr;
+		mapping_size = 0;
+	}
+
+	const uint8_t *data() const { return base; }
+	size_t size() const { return mapping_size; }
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+	const uint8_t *base = nullptr;
+	size_t mapping_size = 0;
+};
+
+/* HEIGHTMAP TILES */
+
+// Terrain height streamed in tiles through a cache of height_tile_slots tiles. Samplers reach a tile through a lock-free
+// table, pinning its slot with a reader count while they read, a tile which is not resident is answered from the
+// overview and queued. The streaming thread loads the tiles requested around the active water and evicts the least
+// recently requested ones, it only reuses a slot once it is unlisted and no reader holds it. Pinning is a seq_cst
+// handshake with the eviction, runs of samples go through a sampler which keeps its tile pinned while they stay in it.
+static const int height_tile_slots = 64; // the whole island fits, larger terrains stream
+
+struct height_tile_cache {
+private:
+	struct tile_entry {
+		std::atomic<int> slot{-1};
+		std::atomic<uint32_t> last_request{0};
+	};
+
+	struct tile_slot {
+		std::vector<uint16_t> samples;
+		std::atomic<int> readers{0};
+		int tile = -1;
+	};
+
+public:
+	~height_tile_cache() { close(); }
+
+	// tiles baked by work/asset_bake height
+	bool open(const char *path) {
+		close();
+
+		file = g_fs->Open(path);
+		if (!file)
+			return false;
+
+		if (g_fs->Read(file, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != baked_height::magic || hdr.version != baked_height::version) {
+			close();
+			return false;
+		}
+
+		tile_desc.resize(hdr.tiles_x * hdr.tiles_z);
+		overview.resize((hdr.width / hdr.overview_step) * (hdr.height / hdr.overview_step));
+		if (!read(hdr.tile_offset, tile_desc.data(), tile_desc.size() * sizeof(baked_height::tile)) ||
+			!read(hdr.overview_offset, overview.data(), overview.size() * sizeof(uint16_t))) {
+			close();
+			return false;
+		}
+
+		start();
+		return true;
+	}
+
+	// Unbaked float heightmap, quantized tile by tile as they are requested. The whole float map stays resident (4 MB
+	// for the 1024 square island), only the baked tiles are streamed from disk.
+	void open_raw(ByteArray &data, uint32_t size, uint32_t tile_size = 128, uint32_t overview_step = 16) {
+		close();
+
+		raw.swap(data);
+		auto in = reinterpret_cast<const float *>(raw.data());
+		auto minmax = std::minmax_element(in, in + size * size);
+
+		hdr = {baked_height::magic, baked_height::version, size, size, tile_size, size / tile_size, size / tile_size, overview_step, 0, 0,
+			*minmax.first, *minmax.second};
+
+		const uint32_t overview_res = size / overview_step;
+		overview.assign(overview_res * overview_res, 0);
+		for (uint32_t z = 0; z < size; ++z)
+			for (uint32_t x = 0; x < size; ++x) {
+				auto &o = overview[x / overview_step + (z / overview_step) * overview_res];
+				o = std::max(o, baked_height::quantize(in[x + z * size], hdr.height_min, hdr.height_max));
+			}
+
+		start();
+	}
+
+	void close() {
+		quit = true;
+		wake.notify_one();
+		if (streamer.joinable())
+			streamer.join();
+
+		if (file)
+			g_fs->Close(file);
+		file = nullptr;
+
+		raw.clear();
+		tile_desc.clear();
+		overview.clear();
+		tiles.reset();
+		slots.reset();
+		hdr = baked_height::header();
+	}
+
+	int width() const { return int(hdr.width); }
+	int height() const { return int(hdr.height); }
+
+	// Samples a run of positions, the tile of the last sample stays pinned until a sample falls in another tile or the
+	// sampler is destroyed. Single thread and short lived, the streamer cannot evict a pinned tile and waits for it.
+	struct sampler {
+		explicit sampler(height_tile_cache &cache) : cache(cache) {}
+		~sampler() { unpin(); }
+
+		// normalized height of a sample, clamped to the map
+		float operator()(int u, int v) {
+			auto &hdr = cache.hdr;
+			u = types::Clamp(u, 0, int(hdr.width) - 1);
+			v = types::Clamp(v, 0, int(hdr.height) - 1);
+
+			int t = u / hdr.tile_size + (v / hdr.tile_size) * hdr.tiles_x;
+			if (t != tile) {
+				unpin();
+				pin(t);
+			}
+
+			if (slot)
+				return baked_height::dequantize(slot->samples[u % hdr.tile_size + (v % hdr.tile_size) * hdr.tile_size], hdr.height_min, hdr.height_max);
+
+			cache.tiles[t].last_request.store(cache.epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			cache.pending = true;
+			cache.misses.fetch_add(1, std::memory_order_relaxed);
+
+			auto q = cache.overview[u / hdr.overview_step + (v / hdr.overview_step) * (hdr.width / hdr.overview_step)];
+			return baked_height::dequantize(q, hdr.height_min, hdr.height_max);
+		}
+
+	private:
+		void pin(int t) {
+			tile = t;
+
+			auto &entry = cache.tiles[t];
+			auto s = entry.slot.load();
+			if (s < 0)
+				return;
+
+			auto &candidate = cache.slots[s];
+			++candidate.readers;
+			if (entry.slot.load() == s) // still listed, the streamer waits for us before reusing it
+				slot = &candidate;
+			else
+				--candidate.readers;
+		}
+
+		void unpin() {
+			if (slot)
+				--slot->readers;
+			slot = nullptr;
+			tile = -1;
+		}
+
+		height_tile_cache &cache;
+		tile_slot *slot = nullptr; // pinned, null while the tile is not resident
+		int tile = -1;
+	};
+
+	// single sample, pins and unpins its tile
+	float sample(int u, int v) { return sampler(*this)(u, v); }
+
+	// a request pass lists the tiles to keep resident, tiles left out of the last passes are evicted first
+	void next_epoch() { ++epoch; }
+
+	void prefetch(int u0, int v0, int u1, int v1) {
+		const int last_x = int(hdr.tiles_x) - 1, last_z = int(hdr.tiles_z) - 1;
+		const int t_x0 = types::Clamp(u0 / int(hdr.tile_size), 0, last_x), t_x1 = types::Clamp(u1 / int(hdr.tile_size), 0, last_x);
+		const int t_z0 = types::Clamp(v0 / int(hdr.tile_size), 0, last_z), t_z1 = types::Clamp(v1 / int(hdr.tile_size), 0, last_z);
+
+		const auto e = epoch.load(std::memory_order_relaxed);
+
+		bool missing = false;
+		for (int z = t_z0; z <= t_z1; ++z)
+			for (int x = t_x0; x <= t_x1; ++x) {
+				auto &t = tiles[x + z * hdr.tiles_x];
+				t.last_request.store(e, std::memory_order_relaxed);
+				missing |= t.slot.load(std::memory_order_relaxed) < 0;
+			}
+
+		if (missing) {
+			pending = true;
+			wake.notify_one();
+		}
+	}
+
+	// block until every requested tile which fits in the cache is resident
+	void flush() {
+		while (pending || streaming)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	int resident_count() const { return resident; }
+	int miss_count() const { return misses; }
+
+private:
+	bool read(uint32_t offset, void *out, size_t size) {
+		g_fs->Seek(file, offset, io::SeekStart);
+		return g_fs->Read(file, out, size) == size;
+	}
+
+	void start() {
+		const auto tile_count = hdr.tiles_x * hdr.tiles_z;
+		tiles.reset(new tile_entry[tile_count]);
+		slots.reset(new tile_slot[height_tile_slots]);
+		for (int i = 0; i < height_tile_slots; ++i)
+			slots[i].samples.resize(hdr.tile_size * hdr.tile_size);
+
+		resident = 0;
+		epoch = 2;
+		quit = false;
+		streamer = std::thread([this] { stream(); });
+	}
+
+	bool load(int t, tile_slot &slot) {
+		auto out = slot.samples.data();
+
+		if (!raw.empty()) {
+			auto in = reinterpret_cast<const float *>(raw.data());
+			const uint32_t x0 = (t % hdr.tiles_x) * hdr.tile_size, z0 = (t / hdr.tiles_x) * hdr.tile_size;
+			for (uint32_t z = 0; z < hdr.tile_size; ++z)
+				for (uint32_t x = 0; x < hdr.tile_size; ++x)
+					*out++ = baked_height::quantize(in[x0 + x + (z0 + z) * hdr.width], hdr.height_min, hdr.height_max);
+			return true;
+		}
+
+		auto &d = tile_desc[t];
+		if (d.size != slot.samples.size() * sizeof(uint16_t))
+			return false;
+
+		if (!(d.flags & baked_height::TileLZ4))
+			return read(d.offset, out, d.size);
+
+		staging.resize(d.packed_size);
+		return read(d.offset, staging.data(), d.packed_size) &&
+			baked_pack::lz4_decompress(staging.data(), d.packed_size, reinterpret_cast<uint8_t *>(out), d.size) == d.size;
+	}
+
+	// a free slot, or the slot of the least recently requested tile outside of the last two passes
+	int reclaim_slot() {
+		const auto e = epoch.load();
+
+		int best = -1;
+		uint32_t best_request = e - 1;
+		for (int s = 0; s < height_tile_slots; ++s) {
+			if (slots[s].tile < 0)
+				return s;
+
+			auto request = tiles[slots[s].tile].last_request.load(std::memory_order_relaxed);
+			if (request < best_request) {
+				best = s;
+				best_request = request;
+			}
+		}
+
+		if (best >= 0) {
+			auto &slot = slots[best];
+			tiles[slot.tile].slot = -1; // unlist, then wait for the readers which pinned it before
+			while (slot.readers)
+				std::this_thread::yield();
+			slot.tile = -1;
+			--resident;
+		}
+		return best;
+	}
+
+	void stream() {
+		const int tile_count = int(hdr.tiles_x * hdr.tiles_z);
+
+		while (!quit) {
+			{
+				std::unique_lock<std::mutex> lock(wake_mutex);
+				wake.wait_for(lock, std::chrono::milliseconds(50), [this] { return pending || quit; });
+			}
+
+			streaming = true;
+			pending = false;
+
+			const auto e = epoch.load();
+			for (int t = 0; t < tile_count && !quit; ++t) {
+				auto &entry = tiles[t];
+				if (entry.slot >= 0 || entry.last_request + 1 < e)
+					continue; // resident or not wanted anymore
+
+				auto s = reclaim_slot();
+				if (s < 0)
+					break; // every slot holds a tile of the last passes
+
+				if (load(t, slots[s])) {
+					slots[s].tile = t;
+					entry.slot = s;
+					++resident;
+				}
+			}
+
+			streaming = false;
+		}
+	}
+
+	io::Handle *file = nullptr;
+	ByteArray raw;
+
+	baked_height::header hdr = baked_height::header();
+	std::vector<baked_height::tile> tile_desc;
+	std::vector<uint16_t> overview;
+
+	std::unique_ptr<tile_entry[]> tiles;
+	std::unique_ptr<tile_slot[]> slots;
+	std::vector<uint8_t> staging;
+
+	std::atomic<uint32_t> epoch{2};
+	std::atomic<bool> pending{false}, streaming{false}, quit{false};
+	std::atomic<int> resident{0}, misses{0};
+
+	std::thread streamer;
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+};
+
+height_tile_cache heightmap_tiles; // sampled from the simulation and render threads
 
-ByteArray heightmap;
+/* PARTICLE FIELD */
 
 Vector3 world_to_field(const Vector3 &w);
+Vector3 field_to_world(const Vector3 &f);
+bool scene_sdf_sample(const Vector3 &p, float &d, Vector3 &grad);
+void wake_field_chunks();
+
+// Solver configurations. Every member is a compile time constant, the solver is instantiated per configuration so
+// the kernels fold them, update_particle_field picks the instantiation at runtime.
+struct solver_config {
+	static constexpr int sweep_axis = 0; // x
+
+	static constexpr float field_min_x = -16.f, field_min_y = 0.f, field_min_z = -16.f;
+	static constexpr float field_max_x = 16.f, field_max_y = 4.f, field_max_z = 16.f;
+
+	static constexpr float cohesion_limit = 2.f;
+	static constexpr float cohesion_k = -0.001f, repulsion_k = 0.475f; // beyond and within unit distance
+	static constexpr float gravity = 0.025f, damping = 0.98f, restitution = 0.5f;
+
+	static constexpr int step_frames = 1; // frames covered by a step, which is also the step length
+	static constexpr bool ground_normal = true; // floor against the height only otherwise
+	static constexpr bool proxies = false; // proxy particles are left out of the pair solve
+};
+
+// background fidelity tier, see sim_fidelity
+struct background_solver_config : solver_config {
+	static constexpr int step_frames = 3;
+	static constexpr bool ground_normal = false;
+	static constexpr bool proxies = true;
+};
 
-Vector3 field_min(-16, 0, -16), field_max(16, 4, 16), field_res(1, 1, 1), field_size = field_max - field_min;
+constexpr float const_pow(float b, int e) { return e > 0 ? b * const_pow(b, e - 1) : 1.f; }
 
-static const float cohesion_limit = 2.f;
-static const float field_collision_restitution = 0.5f;
+template <int axis> inline float axis_value(const Vector3 &v) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
+
+const Vector3 field_min(solver_config::field_min_x, solver_config::field_min_y, solver_config::field_min_z);
+const Vector3 field_max(solver_config::field_max_x, solver_config::field_max_y, solver_config::field_max_z);
+const Vector3 field_res(1, 1, 1), field_size = field_max - field_min;
+
+static const float cohesion_limit = solver_config::cohesion_limit;
 
 struct particle {
 	Vector3 pos, vel, acc;
+	uint32_t id; // creation index, stable across reorders
+	bool proxy; // left out of the pair solve by the background tier
 };
 
-void init_particle(particle &p, const Vector3 &pos) {
+void init_particle(particle &p, const Vector3 &pos, uint32_t id, bool proxy) {
 	p.pos = pos;
 	p.vel.Set(0, 0, 0);
 	p.acc.Set(0, 0, 0);
+	p.id = id;
+	p.proxy = proxy;
 }
 
+// Fidelity tier. While the scene is hidden the background tier steps less often with a larger step, solves pairs on
+// one particle in background_particle_stride and floors particles against the height only. Proxy particles are blended
+// back into the pair solve as the fidelity returns to 1.
+float sim_fidelity = 1.f; // 0 background, 1 full
+
+static const float sim_step = 1.f / 60.f; // the simulation thread steps the field at a fixed rate
+
+static const int background_particle_stride = 4;
+static const float fidelity_blend_duration = 1.f; // seconds of simulation time from background to full
+
 std::vector<particle> particles;
+std::vector<uint8_t> particle_neighbors; // neighbors within cohesion_limit during the last step, in particles order
 
 //
 struct totem {
@@ -57,6 +712,9 @@ struct totem {
 std::array<totem, 3> totems;
 uint active_totems = 0;
 
+std::array<Vector3, 3> field_totems; // simulation side copy
+uint field_totem_count = 0;
+
 struct home {
 	Vector3 pos;
 	float energy;
@@ -66,6 +724,19 @@ std::vector<home> homes;
 float total_homes_energy;
 bool take_damage = false;
 
+// Impact statistics of a home, accumulated over the current wave. Only the awake particles are tested, a flood that
+// settled around a home and fell asleep records no hits until its chunk wakes again, asleep water does not move and
+// would deal no damage either.
+struct home_impact {
+	float peak_velocity;
+	uint32_t hits; // particle contacts, one per awake particle and step
+	float damage;
+};
+
+std::vector<home_impact> home_impacts; // in homes order
+
+void reset_home_impacts() { home_impacts.assign(homes.size(), home_impact{0.f, 0, 0.f}); }
+
 //
 void reset_homes_energy() {
 	for (auto &h : homes)
@@ -98,6 +769,7 @@ void spawn_homes(core::Scene &scn) {
 		}
 
 	reset_homes_energy();
+	reset_home_impacts();
 	total_homes_energy = get_homes_energy();
 }
 
@@ -114,7 +786,7 @@ void create_particle_field() {
 	for (auto x = field_min.x; x < field_max.x; x += field_res.x) {
 		for (auto y = field_min.y; y < field_max.y; y += field_res.y) {
 			for (auto z = field_min.z; z < field_max.z; z += field_res.z) {
-				init_particle(particles[i], Vector3(x, y, z));
+				init_particle(particles[i], Vector3(x, y, z), i, i % background_particle_stride != 0);
 				++i;
 			}
 		}
@@ -122,25 +794,42 @@ void create_particle_field() {
 
 	__ASSERT__(i == particle_count);
 
+	wake_field_chunks();
+
 	log(stringify("%1 particle(s)").arg(particle_count));
 }
 
 // 7.f
 const float altitude_min = 5.66898f, altitude_max = 47.22528f;
 
-void particle_sample_ground(const Vector3 &pos, Vector3 &n, float &h) {
+static const int heightmap_normal_span = 10; // in samples
+
+static void heightmap_texel(const Vector3 &pos, int &u, int &v) {
 	auto p = (pos - field_min) / field_size;
 	p.z = 1.f - p.z;
-	int u = p.x * 1024.f, v = p.z * 1024.f;
+	u = types::Clamp(int(p.x * heightmap_tiles.width()), 0, heightmap_tiles.width() - heightmap_normal_span - 1);
+	v = types::Clamp(int(p.z * heightmap_tiles.height()), 0, heightmap_tiles.height() - heightmap_normal_span - 1);
+}
+
+// ground altitude only, for callers which do not need the normal
+float particle_sample_height(const Vector3 &pos, height_tile_cache::sampler &heights) {
+	int u, v;
+	heightmap_texel(pos, u, v);
+	return heights(u, v) * altitude_max + altitude_min;
+}
 
-	u = types::Clamp(u, 0, 1013);
-	v = types::Clamp(v, 0, 1013);
+float particle_sample_height(const Vector3 &pos) {
+	height_tile_cache::sampler heights(heightmap_tiles);
+	return particle_sample_height(pos, heights);
+}
 
-	float *p_f = reinterpret_cast<float *>(heightmap.data());
+void particle_sample_ground(const Vector3 &pos, Vector3 &n, float &h, height_tile_cache::sampler &heights) {
+	int u, v;
+	heightmap_texel(pos, u, v);
 
-	float hc = p_f[u + v * 1024];
-	float hr = p_f[(u + 10) + v * 1024];
-	float hb = p_f[u + (v + 10) * 1024];
+	float hc = heights(u, v);
+	float hr = heights(u + heightmap_normal_span, v);
+	float hb = heights(u, v + heightmap_normal_span);
 
 	Vector3 i(0.1, hr - hc, 0), j(0, hb - hc, -0.1);
 	n = i.Normalized().Cross(j.Normalized());
@@ -148,246 +837,1459 @@ void particle_sample_ground(const Vector3 &pos, Vector3 &n, float &h) {
 	h = hc * altitude_max + altitude_min;
 }
 
-#define AXIS_ACCEL x
-
-void update_particle_field() {
-	auto count = particles.size();
+void particle_sample_ground(const Vector3 &pos, Vector3 &n, float &h) {
+	height_tile_cache::sampler heights(heightmap_tiles);
+	particle_sample_ground(pos, n, h, heights);
+}
 
-	// SAP?
-	std::sort(particles.begin(), particles.end(), [](const particle &a, const particle &b) { return a.pos.AXIS_ACCEL < b.pos.AXIS_ACCEL; });
+// Field partition. The field is cut into columns of field_chunk_size along x and z. A chunk whose water stayed under
+// particle_sleep_velocity for field_chunk_sleep_steps falls asleep, its particles are frozen and left out of the solve
+// and the integration, awake particles still read them as static neighbors. A chunk wakes when water moves in one of
+// the chunks around it, when a totem stands in it, when the wave strength changes enough to kick it or when the whole
+// field is disturbed. Chunks within field_chunk_view_distance of the eye never sleep, the water in view keeps its
+// detail. A steady wave only pushes the awake particles, water it piled up settles and sleeps. Chunk membership is
+// refreshed with the neighbor lists, particles migrate across chunk borders then, none moved more than half the skin
+// in between. The domain is still the fixed solver_config box, see field_min/field_max.
+static const float field_chunk_size = 4.f;
+static const int field_chunk_res_x = int((solver_config::field_max_x - solver_config::field_min_x) / field_chunk_size);
+static const int field_chunk_res_z = int((solver_config::field_max_z - solver_config::field_min_z) / field_chunk_size);
+static const int field_chunk_count = field_chunk_res_x * field_chunk_res_z;
+
+static const float particle_sleep_velocity = 0.005f;
+static const int field_chunk_sleep_steps = 60;
+static const float field_chunk_view_distance = 250.f; // world units
+
+Vector3 field_chunk_eye(1e9f, 1e9f, 1e9f); // world, sent by the main thread, no chunk is near until then
+
+struct field_chunk {
+	float peak_speed; // fastest particle during the last step
+	int calm_steps; // consecutive steps under particle_sleep_velocity
+	bool awake;
+};
 
-	// cohesion/repulsion
-	int nn_count = 0;
+std::array<field_chunk, field_chunk_count> field_chunks;
 
-#if 1
-	for (int i = 0; i < count; ++i) {
-		auto &p_a = particles[i];
+std::vector<uint32_t> chunk_offsets, chunk_particles; // CSR particle indices of each chunk, in particles order
+std::vector<uint32_t> awake_particles; // particles of the awake chunks, chunk by chunk
 
-		// determine range start
-		int j = i;
-		for (; j > 0; --j)
-			if (particles[j].pos.AXIS_ACCEL < p_a.pos.AXIS_ACCEL - cohesion_limit)
-				break; // too far behind
+int awake_chunk_count = 0;
 
-		for (; j < count; ++j) {
-			if (i == j)
-				continue;
+static int field_chunk_index(const Vector3 &pos) {
+	int x = types::Clamp(int((pos.x - field_min.x) / field_chunk_size), 0, field_chunk_res_x - 1);
+	int z = types::Clamp(int((pos.z - field_min.z) / field_chunk_size), 0, field_chunk_res_z - 1);
+	return x + z * field_chunk_res_x;
+}
 
-			++nn_count;
+void wake_field_chunks() {
+	for (auto &c : field_chunks)
+		c = field_chunk{0.f, 0, true};
+}
 
-			auto &p_b = particles[j];
+// the wave kick grows with the distance to the max z wall, wake the chunk rows a change of strength kicks noticeably
+void wake_wave_chunks(float wave_change) {
+	for (int z = 0; z < field_chunk_res_z; ++z) {
+		float kick = fabsf(wave_change) * (field_max.z - (field_min.z + z * field_chunk_size)); // strongest at the row min
+		if (kick < particle_sleep_velocity)
+			continue;
+
+		for (int x = 0; x < field_chunk_res_x; ++x) {
+			auto &c = field_chunks[x + z * field_chunk_res_x];
+			if (!c.awake)
+				c = field_chunk{0.f, 0, true};
+		}
+	}
+}
 
-			if (p_b.pos.AXIS_ACCEL > p_a.pos.AXIS_ACCEL + cohesion_limit)
-				break; // too far front
+void collect_awake_particles() {
+	awake_particles.clear();
+	awake_chunk_count = 0;
 
-			auto a_to_b = p_b.pos - p_a.pos;
-			auto a_to_b_len = a_to_b.Len();
+	for (int c = 0; c < field_chunk_count; ++c)
+		if (field_chunks[c].awake) {
+			awake_particles.insert(awake_particles.end(), chunk_particles.begin() + chunk_offsets[c], chunk_particles.begin() + chunk_offsets[c + 1]);
+			++awake_chunk_count;
+		}
+}
 
-			if (!a_to_b_len)
-				continue;
+// bucket the particles by chunk, counting sort so each chunk lists its particles in particles order
+void build_field_chunk_lists() {
+	const int count = int(particles.size());
 
-			if (a_to_b_len > cohesion_limit)
-				continue;
+	auto chunk_of = scratch->alloc_array<uint16_t>(count);
+	chunk_offsets.assign(field_chunk_count + 1, 0);
+	for (int i = 0; i < count; ++i) {
+		chunk_of[i] = uint16_t(field_chunk_index(particles[i].pos));
+		++chunk_offsets[chunk_of[i] + 1];
+	}
 
-			float k;
-			if (a_to_b_len > 1.f) {
-				k = (cohesion_limit - a_to_b_len) * -0.001f;
-			}
-			else {
-				k = (1.f - a_to_b_len) * 0.475f;
-			}
+	for (int c = 0; c < field_chunk_count; ++c)
+		chunk_offsets[c + 1] += chunk_offsets[c];
 
-			k = k * k;
+	auto cursor = scratch->alloc_array<uint32_t>(field_chunk_count);
+	std::copy(chunk_offsets.begin(), chunk_offsets.end() - 1, cursor);
 
-			auto I = a_to_b * k;
-			p_a.acc -= I;
-			p_b.acc += I;
-		}
-	}
-#else
+	chunk_particles.resize(count);
 	for (int i = 0; i < count; ++i)
-		for (int j = 0; j < count; ++j) {
-			if (i == j)
-				continue;
+		chunk_particles[cursor[chunk_of[i]]++] = uint32_t(i);
+}
 
-			++nn_count;
+// after the step, chunks which settled fall asleep and the chunks around moving water wake up
+void update_field_chunks() {
+	for (auto &c : field_chunks)
+		if (c.awake)
+			c.calm_steps = c.peak_speed < particle_sleep_velocity ? c.calm_steps + 1 : 0;
 
-			auto &p_a = particles[i];
-			auto &p_b = particles[j];
+	std::array<bool, field_chunk_count> disturbed;
+	disturbed.fill(false);
 
-			auto a_to_b = p_b.pos - p_a.pos;
-			auto a_to_b_len = a_to_b.Len();
+	for (int z = 0; z < field_chunk_res_z; ++z)
+		for (int x = 0; x < field_chunk_res_x; ++x) {
+			auto &c = field_chunks[x + z * field_chunk_res_x];
+			if (c.peak_speed < particle_sleep_velocity)
+				continue; // credited by position, water entering an asleep chunk counts
 
-			if (!a_to_b_len)
-				continue;
+			for (int n_z = std::max(z - 1, 0); n_z <= std::min(z + 1, field_chunk_res_z - 1); ++n_z)
+				for (int n_x = std::max(x - 1, 0); n_x <= std::min(x + 1, field_chunk_res_x - 1); ++n_x)
+					disturbed[n_x + n_z * field_chunk_res_x] = true;
+		}
 
-			if (a_to_b_len > cohesion_limit)
-				continue;
+	for (uint i = 0; i < field_totem_count; ++i)
+		disturbed[field_chunk_index(world_to_field(field_totems[i]))] = true;
 
-			float k;
-			if (a_to_b_len > 1.f) {
-				k = (cohesion_limit - a_to_b_len) * -0.001f;
-			}
-			else {
-				k = (1.f - a_to_b_len) * 0.475f;
-			}
+	std::array<bool, field_chunk_count> in_view;
+	for (int z = 0; z < field_chunk_res_z; ++z)
+		for (int x = 0; x < field_chunk_res_x; ++x) {
+			Vector3 center(field_min.x + (x + 0.5f) * field_chunk_size, (field_min.y + field_max.y) * 0.5f, field_min.z + (z + 0.5f) * field_chunk_size);
+			in_view[x + z * field_chunk_res_x] = Vector3::Dist(field_to_world(center), field_chunk_eye) < field_chunk_view_distance;
+		}
 
-			k = k * k;
+	for (int i = 0; i < field_chunk_count; ++i) {
+		auto &c = field_chunks[i];
 
-			auto I = a_to_b * k;
-			p_a.acc -= I;
-			p_b.acc += I;
+		if (!c.awake && (disturbed[i] || in_view[i])) {
+			c = field_chunk{0.f, 0, true};
 		}
-#endif
+		else if (c.awake && !in_view[i] && c.calm_steps >= field_chunk_sleep_steps) {
+			c.awake = false;
+			for (auto n = chunk_offsets[i]; n < chunk_offsets[i + 1]; ++n)
+				particles[chunk_particles[n]].vel.Set(0, 0, 0); // frozen in place
+		}
+
+		c.peak_speed = 0.f;
+	}
+}
 
-	//	log(stringify("pair tested: %1").arg(nn_count));
+// Static forces baked in a 2D grid over the field, the totem cylinders are rasterized once when the totems change and a
+// particle reads a single bilinear sample whatever the number of totems.
+static const float totem_repulsion_dist = 2.0f;
 
-	// totem repulsion
-	static const float totem_repulsion_dist = 2.0f;
+static const float force_grid_cell = 0.25f; // in field units
+static const int force_grid_res_x = int((solver_config::field_max_x - solver_config::field_min_x) / force_grid_cell) + 1;
+static const int force_grid_res_z = int((solver_config::field_max_z - solver_config::field_min_z) / force_grid_cell) + 1;
 
-	for (uint i = 0; i < active_totems; ++i) {
-		Vector3 totem_field_pos = world_to_field(totems[i].pos);
+std::vector<float> force_grid; // x and z force of each node, x -> z
+bool force_grid_valid = false;
 
-		for (int j = 0; j < count; ++j) {
-			auto &p = particles[j];
+void bake_force_grid() {
+	force_grid.assign(force_grid_res_x * force_grid_res_z * 2, 0.f);
 
-			auto p_to_totem = p.pos - totem_field_pos;
-			p_to_totem.y = 0.f; // cylinder
-			auto d_to_totem = p_to_totem.Len();
+	for (uint i = 0; i < field_totem_count; ++i) {
+		auto totem_field_pos = world_to_field(field_totems[i]);
 
-			if (d_to_totem > totem_repulsion_dist)
-				continue;
+		int x0 = std::max(int((totem_field_pos.x - totem_repulsion_dist - field_min.x) / force_grid_cell), 0);
+		int x1 = std::min(int((totem_field_pos.x + totem_repulsion_dist - field_min.x) / force_grid_cell) + 1, force_grid_res_x - 1);
+		int z0 = std::max(int((totem_field_pos.z - totem_repulsion_dist - field_min.z) / force_grid_cell), 0);
+		int z1 = std::min(int((totem_field_pos.z + totem_repulsion_dist - field_min.z) / force_grid_cell) + 1, force_grid_res_z - 1);
 
-			float k = totem_repulsion_dist - d_to_totem;
-			auto repulsion = p_to_totem * (k / d_to_totem);
+		for (int z = z0; z <= z1; ++z)
+			for (int x = x0; x <= x1; ++x) {
+				float d_x = field_min.x + x * force_grid_cell - totem_field_pos.x;
+				float d_z = field_min.z + z * force_grid_cell - totem_field_pos.z;
+				float d_to_totem = sqrtf(d_x * d_x + d_z * d_z); // cylinder
 
-			p.acc += repulsion * 1.f;
-		}
+				if (d_to_totem > totem_repulsion_dist || !d_to_totem)
+					continue;
+
+				float k = (totem_repulsion_dist - d_to_totem) / d_to_totem;
+
+				auto node = &force_grid[(x + z * force_grid_res_x) * 2];
+				node[0] += d_x * k;
+				node[1] += d_z * k;
+			}
 	}
 
-	// home damage
-	if (take_damage)
-		for (uint i = 0; i < homes.size(); ++i) {
-			Vector3 home_field_pos = world_to_field(homes[i].pos);
+	force_grid_valid = true;
+}
 
-			for (int j = 0; j < count; ++j) {
-				auto &p = particles[j];
+Vector3 sample_force_grid(const Vector3 &pos) {
+	float g_x = math::Clamp((pos.x - field_min.x) / force_grid_cell, 0.f, float(force_grid_res_x - 1));
+	float g_z = math::Clamp((pos.z - field_min.z) / force_grid_cell, 0.f, float(force_grid_res_z - 1));
 
-				auto p_to_totem = p.pos - home_field_pos;
-				auto d_to_totem = p_to_totem.Len();
+	int x = std::min(int(g_x), force_grid_res_x - 2), z = std::min(int(g_z), force_grid_res_z - 2);
+	float f_x = g_x - x, f_z = g_z - z;
 
-				if (d_to_totem > 1.f)
-					continue;
+	auto n00 = &force_grid[(x + z * force_grid_res_x) * 2], n10 = n00 + 2;
+	auto n01 = n00 + force_grid_res_x * 2, n11 = n01 + 2;
 
-				float damage = p.vel.Len();
-				homes[i].energy -= damage * 0.6f;
-			}
-		}
+	float w00 = (1.f - f_x) * (1.f - f_z), w10 = f_x * (1.f - f_z), w01 = (1.f - f_x) * f_z, w11 = f_x * f_z;
+	return Vector3(n00[0] * w00 + n10[0] * w10 + n01[0] * w01 + n11[0] * w11, 0.f, n00[1] * w00 + n10[1] * w10 + n01[1] * w01 + n11[1] * w11);
+}
 
-	// constraint & integration
-	for (int i = 0; i < count; ++i) {
-		auto &p = particles[i];
+// keep the terrain under the awake chunks and the chunks around them resident, those wake first
+void prefetch_field_heightmap() {
+	heightmap_tiles.next_epoch();
 
-		// gravity
-		p.acc.y -= 0.025f;
+	for (int z = 0; z < field_chunk_res_z; ++z)
+		for (int x = 0; x < field_chunk_res_x; ++x) {
+			if (!field_chunks[x + z * field_chunk_res_x].awake)
+				continue;
 
-		// field limit constraints
-		if (p.pos.x > field_max.x) {
-			p.pos.x = field_max.x;
-			p.vel.x *= -field_collision_restitution;
-		}
-		if (p.pos.z > field_max.z) {
-			p.pos.z = field_max.z;
-			p.vel.z *= -field_collision_restitution;
-		}
-		if (p.pos.x < field_min.x) {
-			p.pos.x = field_min.x;
-			p.vel.x *= -field_collision_restitution;
-		}
-		if (p.pos.z < field_min.z) {
-			p.pos.z = field_min.z;
-			p.vel.z *= -field_collision_restitution;
+			Vector3 lo(field_min.x + (x - 1) * field_chunk_size, 0, field_min.z + (z - 1) * field_chunk_size);
+			Vector3 hi(field_min.x + (x + 2) * field_chunk_size, 0, field_min.z + (z + 2) * field_chunk_size);
+
+			int u0, v0, u1, v1;
+			heightmap_texel(lo, u0, v1); // the heightmap runs along -z
+			heightmap_texel(hi, u1, v0);
+			heightmap_tiles.prefetch(u0, v0, u1 + heightmap_normal_span, v1 + heightmap_normal_span);
 		}
+}
 
-		// integration
-		p.vel += p.acc;
-		p.pos += p.vel;
-		p.acc.Set(0, 0, 0);
+// Home damage as a reduction keyed by home index. Each chunk of particles reduces into its own row of partial
+// impacts, rows are then combined in chunk order so the result does not depend on how the chunks were scheduled.
+static const float home_damage_factor = 0.6f;
+static const int home_damage_grain = 1024;
 
-		// floor
-		Vector3 n;
-		float y_ground;
-		particle_sample_ground(p.pos, n, y_ground);
-		y_ground /= 4; // field is 4 unit high, iso is 16 unit high
+void accumulate_home_damage() {
+	const int count = int(awake_particles.size()), home_count = int(homes.size());
+	const int chunk_count = (count + home_damage_grain - 1) / home_damage_grain;
 
-		if (p.pos.y < y_ground) {
-			float d = y_ground - p.pos.y;
-			p.vel.y = 0.f; // stop current motion
-			p.vel += n * d * 0.1f;
-		}
+	auto home_field_pos = scratch->alloc_array<Vector3>(home_count);
+	for (int i = 0; i < home_count; ++i)
+		home_field_pos[i] = world_to_field(homes[i].pos);
 
-		// damping
-		p.vel *= 0.98f;
-	}
-}
+	auto partials = scratch->alloc_array<home_impact>(chunk_count * home_count);
+	std::fill(partials, partials + chunk_count * home_count, home_impact{0.f, 0, 0.f});
 
-void draw_cross(core::SimpleGraphicSceneOverlay &gfx, const Vector3 &pos) {
-	//	gfx.Line(pos.x - 0.1, pos.y, pos.z, pos.x + 0.1, pos.y, pos.z, Color::White, Color::White);
-	//	gfx.Line(pos.x, pos.y - 0.1, pos.z, pos.x, pos.y + 0.1, pos.z, Color::White, Color::White);
-	gfx.Line(pos.x, pos.y, pos.z - 0.1, pos.x, pos.y, pos.z + 0.1, Color::White, Color::White);
-}
+	workers.parallel_for(0, count, home_damage_grain, [&](int begin, int end) {
+		for (int c = begin; c < end; c += home_damage_grain) {
+			auto row = partials + (c / home_damage_grain) * home_count;
 
-void apply_wave(float k = 0.01f) {
-	auto count = particles.size();
-	for (int i = 0; i < count; ++i) {
+			for (int j = c, e = std::min(c + home_damage_grain, end); j < e; ++j) {
+				auto &p = particles[awake_particles[j]]; // asleep particles do not move
+
+				float speed = -1.f; // only evaluated on contact
+				for (int i = 0; i < home_count; ++i) {
+					if (Vector3::Dist2(p.pos, home_field_pos[i]) > 1.f)
+						continue;
+
+					if (speed < 0.f)
+						speed = p.vel.Len();
+
+					auto &impact = row[i];
+					impact.peak_velocity = std::max(impact.peak_velocity, speed);
+					++impact.hits;
+					impact.damage += speed * home_damage_factor;
+				}
+			}
+		}
+	});
+
+	for (int c = 0; c < chunk_count; ++c)
+		for (int i = 0; i < home_count; ++i) {
+			auto &partial = partials[c * home_count + i];
+			if (!partial.hits)
+				continue;
+
+			auto &impact = home_impacts[i];
+			impact.peak_velocity = std::max(impact.peak_velocity, partial.peak_velocity);
+			impact.hits += partial.hits;
+			impact.damage += partial.damage;
+
+			homes[i].energy -= partial.damage;
+		}
+}
+
+// CFL limit of the integration, a particle moves at most a quarter of the particle spacing per substep
+static const float cfl_max_travel = 0.25f;
+static const int cfl_max_substeps = 8;
+
+int particle_substeps = 0; // over all particles during the last step
+
+// Verlet neighbor lists. Candidates within cohesion_limit + neighbor_skin are stored in CSR form, the neighbors of
+// particle i being neighbor_indices[neighbor_offsets[i]] to neighbor_indices[neighbor_offsets[i + 1]]. Lists are
+// reused until a particle moved more than half the skin since they were built, particles are only reordered then.
+static const float neighbor_skin = 0.5f;
+
+std::vector<uint32_t> neighbor_offsets, neighbor_indices;
+std::vector<Vector3> neighbor_build_pos; // in particles order
+
+int neighbor_solve_count = 0; // pair solved particles, a prefix of particles
+bool neighbor_lists_valid = false, neighbor_lists_background = false, neighbor_lists_morton = false;
+
+bool particle_morton_order = true; // Z-order the particles, the x sweep otherwise
+
+int neighbor_list_builds = 0;
+
+bool neighbor_lists_stale(bool background) {
+	if (!neighbor_lists_valid || background != neighbor_lists_background || neighbor_lists_morton != particle_morton_order || neighbor_build_pos.size() != particles.size())
+		return true;
+
+	const float max_displacement = neighbor_skin * 0.5f;
+	for (auto i : awake_particles) // asleep particles did not move since they were listed
+		if (Vector3::Dist2(particles[i].pos, neighbor_build_pos[i]) > max_displacement * max_displacement)
+			return true;
+	return false;
+}
+
+// sweep ordering along the configuration axis, kept to compare against the Z-order
+template <typename Config> void sweep_neighbor_lists(int &solve_count) {
+	const int count = int(particles.size());
+
+	auto axis = [](const particle &p) { return axis_value<Config::sweep_axis>(p.pos); };
+
+	// SAP?
+	solve_count = count;
+
+	if (Config::proxies) {
+		// proxies sort after the solved particles, the pair solve only walks the front of the array
+		std::sort(particles.begin(), particles.end(), [&](const particle &a, const particle &b) { return a.proxy != b.proxy ? b.proxy : axis(a) < axis(b); });
+		solve_count = std::partition_point(particles.begin(), particles.end(), [](const particle &p) { return !p.proxy; }) - particles.begin();
+	}
+	else {
+		std::sort(particles.begin(), particles.end(), [&](const particle &a, const particle &b) { return axis(a) < axis(b); });
+	}
+
+	const float radius = Config::cohesion_limit + neighbor_skin;
+
+	for (int i = 0; i < solve_count; ++i) {
+		auto &p_a = particles[i];
+		neighbor_offsets[i] = uint32_t(neighbor_indices.size());
+
+		// determine range start
+		int j = i;
+		for (; j > 0; --j)
+			if (axis(particles[j]) < axis(p_a) - radius)
+				break; // too far behind
+
+		for (; j < solve_count; ++j) {
+			if (i == j)
+				continue;
+
+			auto &p_b = particles[j];
+
+			if (axis(p_b) > axis(p_a) + radius)
+				break; // too far front
+
+			if (Vector3::Dist2(p_a.pos, p_b.pos) <= radius * radius)
+				neighbor_indices.push_back(uint32_t(j));
+		}
+	}
+}
+
+// Z-order. Particles are sorted by the Morton key of their cell, bits interleaved x then z then y like the iso field
+// layout. A search cell is morton_search_cells cells wide on each axis so it is a key prefix, its particles are
+// contiguous and the neighbor search visits the 27 search cells around a particle.
+static const int morton_axis_bits = 6, morton_search_shift = 2, morton_search_cells = 1 << morton_search_shift;
+static const int morton_search_res = (1 << morton_axis_bits) >> morton_search_shift;
+static const float morton_cell = (cohesion_limit + neighbor_skin) / morton_search_cells;
+
+std::vector<particle> particle_reorder; // swapped with particles after a reorder
+std::vector<uint32_t> morton_search_begin, morton_search_end; // particle range of each search cell, by search cell key
+
+static uint32_t morton_spread(uint32_t v) { // bit n moves to bit 3n, 10 bits
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+static uint32_t morton_key(int x, int y, int z) { return morton_spread(x) | (morton_spread(z) << 1) | (morton_spread(y) << 2); }
+
+// clamped so out of field particles share the border cells, which keeps neighbors in adjacent cells
+static void morton_coords(const Vector3 &pos, int &x, int &y, int &z) {
+	auto c = (pos - field_min) / morton_cell;
+	static const int max_coord = (1 << morton_axis_bits) - 1;
+	x = types::Clamp(int(c.x), 0, max_coord);
+	y = types::Clamp(int(c.y), 0, max_coord);
+	z = types::Clamp(int(c.z), 0, max_coord);
+}
+
+void morton_neighbor_lists(bool background, int &solve_count) {
+	const int count = int(particles.size());
+	static const int key_bits = morton_axis_bits * 3, proxy_bit = 1 << key_bits;
+
+	auto keys = scratch->alloc_array<uint32_t>(count), order = scratch->alloc_array<uint32_t>(count);
+	auto tmp_keys = scratch->alloc_array<uint32_t>(count), tmp_order = scratch->alloc_array<uint32_t>(count);
+
+	workers.parallel_for(0, count, 1024, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int x, y, z;
+			morton_coords(particles[i].pos, x, y, z);
+			keys[i] = morton_key(x, y, z);
+			if (background && particles[i].proxy)
+				keys[i] |= proxy_bit; // proxies sort after the solved particles
+			order[i] = i;
+		}
+	});
+
+	radix_sort(keys, order, tmp_keys, tmp_order, count, background ? key_bits + 1 : key_bits);
+
+	particle_reorder.resize(count);
+	for (int i = 0; i < count; ++i)
+		particle_reorder[i] = particles[order[i]];
+	particles.swap(particle_reorder);
+
+	solve_count = background ? int(std::lower_bound(keys, keys + count, uint32_t(proxy_bit)) - keys) : count;
+
+	// search cell ranges
+	static const int search_key_shift = morton_search_shift * 3;
+
+	morton_search_begin.assign(morton_search_res * morton_search_res * morton_search_res, 0);
+	morton_search_end.assign(morton_search_begin.size(), 0);
+
+	for (int i = 0; i < solve_count;) {
+		auto cell = keys[i] >> search_key_shift;
+		morton_search_begin[cell] = i;
+		while (i < solve_count && (keys[i] >> search_key_shift) == cell)
+			++i;
+		morton_search_end[cell] = i;
+	}
+
+	const float radius = cohesion_limit + neighbor_skin;
+
+	for (int i = 0; i < solve_count; ++i) {
+		auto &p_a = particles[i];
+		neighbor_offsets[i] = uint32_t(neighbor_indices.size());
+
+		int x, y, z;
+		morton_coords(p_a.pos, x, y, z);
+		x >>= morton_search_shift;
+		y >>= morton_search_shift;
+		z >>= morton_search_shift;
+
+		for (int n_y = std::max(y - 1, 0); n_y <= std::min(y + 1, morton_search_res - 1); ++n_y)
+			for (int n_z = std::max(z - 1, 0); n_z <= std::min(z + 1, morton_search_res - 1); ++n_z)
+				for (int n_x = std::max(x - 1, 0); n_x <= std::min(x + 1, morton_search_res - 1); ++n_x) {
+					auto cell = morton_key(n_x, n_y, n_z);
+					for (int j = morton_search_begin[cell], e = morton_search_end[cell]; j < e; ++j)
+						if (j != i && Vector3::Dist2(p_a.pos, particles[j].pos) <= radius * radius)
+							neighbor_indices.push_back(uint32_t(j));
+				}
+	}
+}
+
+// cache lines pulled by the neighbor reads of a solve step, a line is counted again whenever a list leaves it
+int neighbor_cache_lines = 0;
+
+void count_neighbor_cache_lines() {
+	static const size_t cache_line = 64;
+
+	int lines = 0;
+	for (int i = 0; i < neighbor_solve_count; ++i) {
+		size_t last_line = ~size_t(0);
+		for (auto n = neighbor_offsets[i]; n < neighbor_offsets[i + 1]; ++n) {
+			auto line = neighbor_indices[n] * sizeof(particle) / cache_line;
+			if (line != last_line)
+				++lines;
+			last_line = line;
+		}
+	}
+	neighbor_cache_lines = lines;
+}
+
+template <typename Config> void build_neighbor_lists() {
+	const int count = int(particles.size());
+	const bool background = Config::proxies;
+
+	neighbor_offsets.resize(count + 1);
+	neighbor_indices.clear();
+
+	int solve_count;
+	if (particle_morton_order)
+		morton_neighbor_lists(background, solve_count);
+	else
+		sweep_neighbor_lists<Config>(solve_count);
+
+	for (int i = solve_count; i <= count; ++i)
+		neighbor_offsets[i] = uint32_t(neighbor_indices.size());
+
+	neighbor_build_pos.resize(count);
+	for (int i = 0; i < count; ++i)
+		neighbor_build_pos[i] = particles[i].pos;
+
+	// the particles moved in the arrays, asleep particles keep a neighbor count the solve will not refresh
+	build_field_chunk_lists();
+
+	particle_neighbors.assign(count, 0);
+	for (int c = 0; c < field_chunk_count; ++c) {
+		if (field_chunks[c].awake)
+			continue;
+
+		for (auto n = chunk_offsets[c]; n < chunk_offsets[c + 1]; ++n) {
+			auto i = chunk_particles[n];
+			if (int(i) >= solve_count)
+				continue;
+
+			int neighbors = 0;
+			for (auto j = neighbor_offsets[i]; j < neighbor_offsets[i + 1]; ++j)
+				if (Vector3::Dist2(particles[i].pos, particles[neighbor_indices[j]].pos) <= cohesion_limit * cohesion_limit)
+					++neighbors;
+			particle_neighbors[i] = uint8_t(std::min(neighbors, 255));
+		}
+	}
+
+	neighbor_solve_count = solve_count;
+	neighbor_lists_valid = true;
+	neighbor_lists_background = background;
+	neighbor_lists_morton = particle_morton_order;
+	++neighbor_list_builds;
+
+	count_neighbor_cache_lines();
+}
+
+template <typename Config> void step_particle_field() {
+	const float dt = float(Config::step_frames);
+
+	if (neighbor_lists_stale(Config::proxies))
+		build_neighbor_lists<Config>();
+
+	collect_awake_particles();
+	const int awake_count = int(awake_particles.size());
+
+	// cohesion/repulsion, every pair is listed from both ends so each particle only gathers its own impulses
+	workers.parallel_for(0, awake_count, 256, [&](int begin, int end) {
+		for (int k = begin; k < end; ++k) {
+			auto i = awake_particles[k];
+			if (int(i) >= neighbor_solve_count)
+				continue;
+
+			auto &p_a = particles[i];
+			uint8_t p_a_neighbors = 0;
+
+			Vector3 acc(0, 0, 0);
+			for (auto n = neighbor_offsets[i]; n < neighbor_offsets[i + 1]; ++n) {
+				auto &p_b = particles[neighbor_indices[n]];
+
+				auto a_to_b = p_b.pos - p_a.pos;
+				auto a_to_b_len = a_to_b.Len();
+
+				if (!a_to_b_len)
+					continue;
+
+				if (a_to_b_len > Config::cohesion_limit)
+					continue;
+
+				if (p_a_neighbors < 255)
+					++p_a_neighbors;
+
+				float k;
+				if (a_to_b_len > 1.f) {
+					k = (Config::cohesion_limit - a_to_b_len) * Config::cohesion_k;
+				}
+				else {
+					k = (1.f - a_to_b_len) * Config::repulsion_k;
+				}
+
+				k = k * k;
+
+				// proxies fade back in after the background tier
+				if (!Config::proxies && (p_a.proxy || p_b.proxy))
+					k *= sim_fidelity;
+
+				acc -= a_to_b * (k * 2.f); // this side and the reaction from p_b's list
+			}
+
+			p_a.acc += acc;
+			particle_neighbors[i] = p_a_neighbors;
+		}
+	});
+
+	// totem repulsion
+	if (!force_grid_valid)
+		bake_force_grid();
+
+	if (field_totem_count)
+		for (auto j : awake_particles) {
+			auto &p = particles[j];
+			p.acc += sample_force_grid(p.pos);
+		}
+
+	// home damage
+	if (take_damage && !homes.empty())
+		accumulate_home_damage();
+
+	// constraint & integration, fast particles substep so they never travel more than cfl_max_travel at once
+	int substep_count = 0;
+
+	height_tile_cache::sampler heights(heightmap_tiles); // awake particles are listed chunk by chunk, tiles change rarely
+
+	for (auto i : awake_particles) {
 		auto &p = particles[i];
-		p.vel.z += (field_max.z - p.pos.z) * k;
+
+		// gravity
+		p.acc.y -= Config::gravity;
+
+		p.vel += p.acc * dt;
+		p.acc.Set(0, 0, 0);
+
+		int substeps = std::min(int(p.vel.Len() * dt / cfl_max_travel) + 1, cfl_max_substeps);
+		float h = dt / substeps; // floor correction is a rate, scaled by the substep length
+		substep_count += substeps;
+
+		for (int s = 0; s < substeps; ++s) {
+			// field limit constraints
+			if (p.pos.x > Config::field_max_x) {
+				p.pos.x = Config::field_max_x;
+				p.vel.x *= -Config::restitution;
+			}
+			if (p.pos.z > Config::field_max_z) {
+				p.pos.z = Config::field_max_z;
+				p.vel.z *= -Config::restitution;
+			}
+			if (p.pos.x < Config::field_min_x) {
+				p.pos.x = Config::field_min_x;
+				p.vel.x *= -Config::restitution;
+			}
+			if (p.pos.z < Config::field_min_z) {
+				p.pos.z = Config::field_min_z;
+				p.vel.z *= -Config::restitution;
+			}
+
+			// integration
+			p.pos += p.vel * h;
+
+			// floor
+			Vector3 n(0, 1, 0);
+			float y_ground;
+			if (Config::ground_normal)
+				particle_sample_ground(p.pos, n, y_ground, heights);
+			else
+				y_ground = particle_sample_height(p.pos, heights);
+			y_ground /= 4; // field is 4 unit high, iso is 16 unit high
+
+			if (p.pos.y < y_ground) {
+				float d = y_ground - p.pos.y;
+				p.vel.y = 0.f; // stop current motion
+				p.vel += n * (d * 0.1f * h);
+			}
+
+			// static obstacles
+			float d_obstacle;
+			Vector3 grad;
+			if (scene_sdf_sample(p.pos, d_obstacle, grad) && d_obstacle < 0.f) {
+				auto n_obstacle = grad.Normalized();
+				p.pos -= n_obstacle * d_obstacle; // push out along the gradient
+
+				float v_n = p.vel.Dot(n_obstacle);
+				if (v_n < 0.f)
+					p.vel -= n_obstacle * (v_n * (1.f + Config::restitution));
+			}
+		}
+
+		// damping
+		p.vel *= const_pow(Config::damping, Config::step_frames);
+
+		auto &chunk = field_chunks[field_chunk_index(p.pos)];
+		chunk.peak_speed = std::max(chunk.peak_speed, p.vel.Len());
+	}
+
+	particle_substeps = substep_count;
+
+	update_field_chunks();
+}
+
+void update_particle_field() {
+	if (sim_fidelity > 0.f) {
+		step_particle_field<solver_config>();
+		return;
 	}
+
+	static int background_frame = 0;
+	if (++background_frame < background_solver_config::step_frames)
+		return;
+	background_frame = 0;
+
+	step_particle_field<background_solver_config>();
+}
+
+// sleeping chunks rest against the push of the current wave, see wake_wave_chunks
+void apply_wave(float k = 0.01f) {
+	for (int c = 0; c < field_chunk_count; ++c)
+		if (field_chunks[c].awake)
+			for (auto n = chunk_offsets[c]; n < chunk_offsets[c + 1]; ++n) {
+				auto &p = particles[chunk_particles[n]];
+				p.vel.z += (field_max.z - p.pos.z) * k;
+			}
 }
 
+/* FLOOD LOOP */
+
+// A looping recording of the particle field, played back by the simulation thread instead of running the solver while
+// the menu is up. Frames are decoded in sequence straight from the data file (zero copy from a raw pack entry),
+// particles take their recorded position and the velocity of the last frame so the solver resumes smoothly from
+// wherever the loop was. data/flood.loop is recorded by the game itself, see work/convert.bat and record_flood_loop.
+static const char *flood_loop_path = "flood.loop";
+static const int flood_loop_record_frames = 800; // the last quarter is crossfaded into the first, loops every 10s
+static const int flood_loop_warmup_steps = 400; // let the menu wave settle before recording
+static const Vector3 flood_bounds_min(-16, 0, -16), flood_bounds_max(16, 16, 16); // above the field, waves overshoot
+
+bool load_data_file(const char *path, ByteArray &storage, const uint8_t *&data, size_t &size);
+
+struct flood_loop {
+	bool open(const char *path) {
+		if (!load_data_file(path, storage, data, size) || size < sizeof(baked_flood::header))
+			return close();
+
+		hdr = reinterpret_cast<const baked_flood::header *>(data);
+		if (hdr->magic != baked_flood::magic || hdr->version != baked_flood::version || !hdr->frame_count ||
+			hdr->frame_offset + (hdr->frame_count + 1) * sizeof(uint32_t) > size)
+			return close();
+
+		frames = reinterpret_cast<const uint32_t *>(data + hdr->frame_offset);
+		if (frames[hdr->frame_count] > size)
+			return close();
+
+		q.assign(hdr->particle_count * 3, 0);
+		frame = 0;
+		return true;
+	}
+
+	bool close() {
+		storage.clear();
+		data = nullptr;
+		hdr = nullptr;
+		return false;
+	}
+
+	bool is_open() const { return hdr != nullptr; }
+	uint32_t particle_count() const { return hdr->particle_count; }
+
+	// move every particle to the next frame, wraps to the first frame after the last one
+	void play(std::vector<particle> &particles) {
+		if (frame == hdr->frame_count) {
+			std::fill(q.begin(), q.end(), 0); // the first frame is relative to zero
+			frame = 0;
+		}
+
+		auto in = data + frames[frame], end = data + frames[frame + 1];
+		for (auto &v : q) {
+			int32_t d;
+			if (!(in = baked_flood::get_delta(in, end, d)))
+				break;
+			v += d;
+		}
+		++frame;
+
+		for (auto &p : particles) {
+			if (p.id >= hdr->particle_count)
+				continue;
+
+			auto c = &q[p.id * 3];
+			Vector3 pos(baked_flood::dequantize(uint16_t(c[0]), hdr->bounds_min[0], hdr->bounds_max[0]),
+				baked_flood::dequantize(uint16_t(c[1]), hdr->bounds_min[1], hdr->bounds_max[1]),
+				baked_flood::dequantize(uint16_t(c[2]), hdr->bounds_min[2], hdr->bounds_max[2]));
+
+			p.vel = pos - p.pos;
+			p.pos = pos;
+			p.acc.Set(0, 0, 0);
+		}
+	}
+
+private:
+	ByteArray storage; // empty when served from the pack
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	const baked_flood::header *hdr = nullptr;
+	const uint32_t *frames = nullptr;
+
+	uint32_t frame = 0;
+	std::vector<int32_t> q; // quantized coordinates of the current frame, by particle id
+};
+
+// Records frame_count steps of the running simulation then writes them as a seamless loop, the tail of the recording is
+// crossfaded into its head so the last frame flows into the first one.
+struct flood_recorder {
+	void start(int frame_count) {
+		frames.clear();
+		target = frame_count;
+	}
+
+	bool is_recording() const { return target > 0; }
+	int frames_left() const { return target - int(frames.size()); }
+
+	void record(const std::vector<particle> &particles) {
+		auto count = particles.size();
+
+		frames.emplace_back(count * 3);
+		auto &f = frames.back();
+		for (auto &p : particles) {
+			auto c = &f[p.id * 3];
+			c[0] = baked_flood::quantize(p.pos.x, flood_bounds_min.x, flood_bounds_max.x);
+			c[1] = baked_flood::quantize(p.pos.y, flood_bounds_min.y, flood_bounds_max.y);
+			c[2] = baked_flood::quantize(p.pos.z, flood_bounds_min.z, flood_bounds_max.z);
+		}
+
+		if (int(frames.size()) == target) {
+			save(flood_loop_path, uint32_t(count));
+			target = 0;
+			frames.clear();
+		}
+	}
+
+private:
+	void save(const char *path, uint32_t particle_count) {
+		const int fade = int(frames.size()) / 4, loop = int(frames.size()) - fade;
+
+		for (int i = 0; i < fade; ++i) {
+			float t = float(i) / fade;
+			for (size_t c = 0; c < frames[i].size(); ++c)
+				frames[i][c] = uint16_t(frames[loop + i][c] + (frames[i][c] - frames[loop + i][c]) * t + 0.5f);
+		}
+
+		baked_flood::header hdr = {baked_flood::magic, baked_flood::version, particle_count, uint32_t(loop), sizeof(baked_flood::header),
+			{flood_bounds_min.x, flood_bounds_min.y, flood_bounds_min.z}, {flood_bounds_max.x, flood_bounds_max.y, flood_bounds_max.z}};
+
+		// header | frame offsets | frames
+		auto data_offset = sizeof(hdr) + (loop + 1) * sizeof(uint32_t);
+		std::vector<uint8_t> data(data_offset + loop * particle_count * 3 * baked_flood::max_delta_size);
+		memcpy(data.data(), &hdr, sizeof(hdr));
+
+		auto offsets = reinterpret_cast<uint32_t *>(data.data() + sizeof(hdr));
+		auto out = data.data() + data_offset;
+		for (int i = 0; i < loop; ++i) {
+			offsets[i] = uint32_t(out - data.data());
+			for (size_t c = 0; c < frames[i].size(); ++c)
+				out = baked_flood::put_delta(out, int32_t(frames[i][c]) - (i ? int32_t(frames[i - 1][c]) : 0));
+		}
+		offsets[loop] = uint32_t(out - data.data());
+
+		// into the data directory, the pack step picks it up
+		if (!g_fs->FileSave(path, data.data(), out - data.data()))
+			log(stringify("Flood loop: cannot save '%1'").arg(path));
+
+		log(stringify("Flood loop: %1 frames, %2 KB").arg(loop).arg(int((out - data.data()) / 1024)));
+	}
+
+	std::vector<std::vector<uint16_t>> frames; // by particle id
+	int target = 0;
+};
+
+/* SIMULATION THREAD */
+
+// The particle field steps on its own thread at a fixed rate, vsync stalls on the render thread no longer hold it back.
+// Once the thread runs the render thread only reads the snapshots it publishes and drives it with commands.
+//
+// Owned by the simulation thread while it runs, the render thread must not touch them: particles, particle_neighbors,
+// the neighbor lists, field_chunks, field_chunk_eye and the chunk/awake lists, field_totems, homes and home_impacts,
+// take_damage, sim_fidelity, the force grid and the flood loop player and recorder.
+//
+// Shared, read by both threads:
+// - the scene SDF (sdf_*), built before start() and never written again,
+// - heightmap_tiles, sampled by the particle collision and by water culling, picking and the debug draw, its sample
+//   and prefetch are thread safe (see HEIGHTMAP TILES), open and close happen while the thread is stopped,
+// - the iso field inputs are the published snapshot only, the water never reads the live particles.
+
+// single writer single reader, the reader always gets the latest complete publication and neither side blocks
+template <typename T> struct triple_buffer {
+	T &back() { return slots[back_index]; }
+
+	void publish() { back_index = ready.exchange(back_index | fresh, std::memory_order_acq_rel) & ~fresh; }
+
+	// the latest published slot, the same slot as the previous call if nothing was published since
+	const T &acquire() {
+		if (ready.load(std::memory_order_relaxed) & fresh)
+			front_index = ready.exchange(front_index, std::memory_order_acq_rel) & ~fresh;
+		return slots[front_index];
+	}
+
+private:
+	static const int fresh = 4;
+
+	std::array<T, 3> slots;
+	int back_index = 0, front_index = 1;
+	std::atomic<int> ready{2};
+};
+
+// lock-free ring, one producer thread and one consumer thread
+template <typename T, int N> struct spsc_queue {
+	bool push(const T &v) {
+		auto h = head.load(std::memory_order_relaxed), next = (h + 1) % N;
+		if (next == tail.load(std::memory_order_acquire))
+			return false; // full
+		items[h] = v;
+		head.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &v) {
+		auto t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		v = items[t];
+		tail.store((t + 1) % N, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, N> items;
+	std::atomic<int> head{0}, tail{0};
+};
+
+enum sim_command_type {
+	SimWave,
+	SimFullFidelity,
+	SimTakeDamage,
+	SimPlaceTotem,
+	SimClearTotems,
+	SimResetHomes,
+	SimResetImpacts,
+	SimMortonOrder,
+	SimFloodLoop, // play the flood loop instead of stepping the solver
+	SimRecordFloodLoop, // value is the frame count
+	SimViewEye, // pos is the camera world position
+};
+
+struct sim_command {
+	sim_command_type type;
+	float value; // wave strength, or a flag
+	Vector3 pos;
+};
+
+struct sim_stats {
+	int substeps, list_builds, pairs, cache_lines;
+	int flood_record_left;
+	int awake_chunks, awake_particles;
+};
+
+struct sim_snapshot {
+	std::vector<particle> particles;
+	std::vector<uint8_t> neighbors; // see particle_neighbors
+	std::vector<uint8_t> awake; // 1 when the particle belongs to an awake chunk
+
+	float homes_energy;
+	std::vector<home_impact> impacts;
+
+	uint32_t step; // simulation steps taken, the game state timers count them
+	sim_stats stats;
+};
+
+struct sim_thread {
+	~sim_thread() { stop(); }
+
+	// the field, homes and static collision must be ready, the first snapshot is published before returning
+	void start() {
+		if (flood.open(flood_loop_path) && flood.particle_count() != particles.size())
+			flood.close(); // recorded from another field
+		publish();
+		thread = std::thread([this] { run(); });
+	}
+
+	void stop() {
+		quit = true;
+		if (thread.joinable())
+			thread.join();
+	}
+
+	void send(sim_command_type type, float value = 0.f, const Vector3 &pos = Vector3::Zero) {
+		bool queued = commands.push({type, value, pos});
+		__ASSERT__(queued);
+	}
+
+	const sim_snapshot &view() { return snapshots.acquire(); }
+
+	bool has_flood_loop() const { return flood.is_open(); }
+
+private:
+	void execute(const sim_command &c) {
+		switch (c.type) {
+			case SimWave:
+				wake_wave_chunks(c.value - wave);
+				wave = c.value;
+				break;
+			case SimFullFidelity:
+				full_fidelity = c.value != 0.f;
+				break;
+			case SimTakeDamage:
+				take_damage = c.value != 0.f;
+				break;
+			case SimPlaceTotem:
+				if (field_totem_count < field_totems.size())
+					field_totems[field_totem_count++] = c.pos;
+				force_grid_valid = false;
+				break;
+			case SimClearTotems:
+				field_totem_count = 0;
+				force_grid_valid = false;
+				break;
+			case SimResetHomes:
+				reset_homes_energy();
+				break;
+			case SimResetImpacts:
+				reset_home_impacts();
+				break;
+			case SimMortonOrder:
+				particle_morton_order = c.value != 0.f;
+				break;
+			case SimFloodLoop:
+				flood_playing = c.value != 0.f && flood.is_open();
+				break;
+			case SimRecordFloodLoop:
+				recorder.start(int(c.value));
+				break;
+			case SimViewEye:
+				field_chunk_eye = c.pos;
+				break;
+		}
+	}
+
+	void publish() {
+		auto &s = snapshots.back();
+		s.particles = particles;
+		s.neighbors = particle_neighbors;
+		s.awake.assign(particles.size(), 0);
+		for (auto i : awake_particles)
+			s.awake[i] = 1;
+		s.homes_energy = get_homes_energy();
+		s.impacts = home_impacts;
+		s.step = steps;
+		s.stats = {particle_substeps, neighbor_list_builds, int(neighbor_indices.size()), neighbor_cache_lines, recorder.frames_left(), awake_chunk_count,
+			int(awake_particles.size())};
+		snapshots.publish();
+	}
+
+	void step() {
+		for (sim_command c; commands.pop(c);)
+			execute(c);
+
+		if (full_fidelity)
+			sim_fidelity = math::Min(sim_fidelity + sim_step / fidelity_blend_duration, 1.f);
+		else
+			sim_fidelity = 0.f;
+
+		if (flood_playing) {
+			flood.play(particles);
+			neighbor_lists_valid = false; // teleported
+			wake_field_chunks();
+		}
+		else {
+			update_particle_field();
+			if (wave)
+				apply_wave(wave);
+
+			if (recorder.is_recording())
+				recorder.record(particles);
+		}
+
+		prefetch_field_heightmap();
+
+		++steps;
+		publish();
+		scratch->reset();
+	}
+
+	void run() {
+		scratch = &sim_scratch;
+
+		typedef std::chrono::steady_clock clock;
+		const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(sim_step));
+
+		auto next = clock::now();
+		while (!quit) {
+			step();
+
+			next += period;
+			auto now = clock::now();
+			if (next + period * 4 < now)
+				next = now; // too far behind, drop the backlog rather than spiral
+			std::this_thread::sleep_until(next);
+		}
+	}
+
+	std::thread thread;
+	std::atomic<bool> quit{false};
+
+	spsc_queue<sim_command, 256> commands;
+	triple_buffer<sim_snapshot> snapshots;
+
+	float wave = 0.f; // apply_wave strength every step
+	bool full_fidelity = true;
+
+	flood_loop flood;
+	flood_recorder recorder;
+	bool flood_playing = false;
+
+	uint32_t steps = 0;
+};
+
+sim_thread simulation;
+
+const sim_snapshot *sim_view; // acquired by the render thread once per frame
+
+// all homes combined, the peak is the highest of all homes
+home_impact get_wave_impact() {
+	home_impact total{0.f, 0, 0.f};
+	for (auto &impact : sim_view->impacts) {
+		total.peak_velocity = std::max(total.peak_velocity, impact.peak_velocity);
+		total.hits += impact.hits;
+		total.damage += impact.damage;
+	}
+	return total;
+}
+
+const home_impact &get_home_impact(uint i) { return sim_view->impacts[i]; }
+
 //
 static const int iso_scale = 2;
 
 int iso_w = 212 / iso_scale, iso_h = 64 / iso_scale, iso_d = 212 / iso_scale;
 Vector3 iso_min(-212 / iso_scale, 0, -212 / iso_scale), iso_max(212 / iso_scale, 64 / iso_scale, 212 / iso_scale), iso_unit(iso_scale, iso_scale, iso_scale);
 
-core::ScenePicking *scene_picking;
-
-auto water_iso = std::make_shared<core::IsoSurface>(); // x -> z -> y
 std::vector<float> water_field;
 
-render::sGeometry water_geo;
 render::sMaterial water_mat;
 
+// Water is meshed per column block of the iso field. The polygoniser marches n cells over n + 2 samples, like the
+// whole field did, so every block reads a one sample apron on its max side and the blocks own their cells exactly.
+// Blocks far from the view or with a flat surface are polygonised at half resolution, on the even samples. A full
+// resolution block next to a half resolution one conforms the samples of their shared face to the coarse lattice so
+// both contours cross the coarse edges of the face at the same points, the water is translucent and overlapping the
+// blocks would blend the seam twice. Inside each coarse face the fine contour still has a vertex where the coarse one
+// runs straight, small T-junction gaps remain along the seam, transition cells would be needed to close them. Blocks
+// with no water are skipped.
+static const int water_block_size = 16; // in iso cells, even
+
+enum water_lod { WaterEmpty = -1, WaterFull, WaterHalf };
+
+struct water_block {
+	int x, z, w, d; // iso cell range
+	int lod;
+	Vector3 origin; // world translation of the block mesh
+
+	// The polygoniser output is copied to vertex and index buffers created once at the worst case block size, an
+	// update only uploads the used range and draws that many indices.
+	std::shared_ptr<core::IsoSurface> iso; // x -> z -> y
+	render::sGeometry geo;
+};
+
+struct water_vertex {
+	Vector3 pos, normal;
+};
+
+// Marching cubes emits at most 5 triangles per cell and welds a single vertex on each crossed cell edge, a full
+// resolution block bounds both lods. Set by init_water.
+int water_block_max_vertices = 0, water_block_max_indices = 0;
+
+std::vector<water_vertex> water_upload_vertices; // staging, reserved at the worst case
+std::vector<uint16_t> water_upload_indices;
+
+std::vector<water_block> water_blocks; // x -> z
+int water_blocks_x = 0;
+
+float water_lod_distance = 300.f;
+
+// iso cells touched by the splat, inclusive
+struct iso_bounds {
+	int x0, y0, z0, x1, y1, z1;
+
+	void add(int x, int y, int z, int margin) {
+		x0 = std::min(x0, x - margin);
+		y0 = std::min(y0, y - margin);
+		z0 = std::min(z0, z - margin);
+		x1 = std::max(x1, x + margin);
+		y1 = std::max(y1, y + margin);
+		z1 = std::max(z1, z + margin);
+	}
+
+	void clip() {
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		z0 = std::max(z0, 0);
+		x1 = std::min(x1, iso_w - 1);
+		y1 = std::min(y1, iso_h - 1);
+		z1 = std::min(z1, iso_d - 1);
+	}
+
+	bool empty() const { return x1 < x0 || y1 < y0 || z1 < z0; }
+};
+
+iso_bounds water_bounds;
+int iso_smooth_radius = 1;
+
 const auto particle_to_iso_cell = Vector3(iso_w, iso_h, iso_d) / (Vector3(field_max.x, 16, field_max.z) - field_min);
 
 Vector3 world_to_field(const Vector3 &w) {
 	return (w - iso_min) * (field_max - field_min) / (iso_max - iso_min) + field_min;
 }
 
+// particle position to world, as the water surface is drawn
+Vector3 field_to_world(const Vector3 &f) { return (f - field_min) * particle_to_iso_cell * float(iso_scale) + iso_min; }
+
+/* STATIC COLLISION */
+
+// Signed distance to the static obstacles of the scene, sampled on a sparse brick grid in particle field space. Only
+// bricks near an obstacle are stored, the others read as free space. Bricks carry a one sample apron so a trilinear
+// lookup never straddles two bricks. Obstacles are the oriented bounds of the named scene objects taken to field space
+// per axis, field cells are not cubic in the world. The full bounds of the bridge and arches would dam the river, only
+// their top slab is kept: the deck stands above the river and stops the waves that top it.
+struct sdf_obstacle {
+	const char *prefix;
+	float top; // fraction of the bounds height kept, from the top
+};
+
+static const sdf_obstacle sdf_obstacles[] = {{"maison", 1.f}, {"eglise", 1.f}, {"fontaine", 1.f}, {"pont", 0.25f}, {"arches", 0.25f}};
+
+static const int sdf_brick = 8; // cells per brick side
+static const int sdf_brick_samples = sdf_brick + 1;
+static const float sdf_cell = 0.25f; // in field units
+
+struct obstacle_box {
+	Vector3 center, axis[3]; // field space, unit axes
+	float half[3];
+
+	float distance(const Vector3 &w) const {
+		auto d = w - center;
+		float q[3], outside = 0.f, inside = -1e9f;
+		for (int i = 0; i < 3; ++i) {
+			q[i] = fabsf(d.Dot(axis[i])) - half[i];
+			outside += q[i] > 0.f ? q[i] * q[i] : 0.f;
+			inside = std::max(inside, q[i]);
+		}
+		return outside > 0.f ? sqrtf(outside) : std::min(inside, 0.f);
+	}
+};
+
+// written before the simulation thread starts, read only by both threads afterwards
+int sdf_bx, sdf_by, sdf_bz; // brick grid size
+std::vector<int32_t> sdf_bricks; // first sample of each brick, -1 if not stored
+std::vector<float> sdf_samples; // in field units
+
+void bake_scene_sdf(core::Scene &scn) {
+	const auto field_to_world_scale = particle_to_iso_cell * float(iso_scale); // see field_to_world
+	const float band = 1.f; // bricks further than this from every obstacle are free space, in field units
+
+	std::vector<obstacle_box> boxes, home_boxes;
+
+	for (auto &node : scn.GetNodes()) {
+		auto object = node->GetComponent<core::Object>();
+		if (!object)
+			continue;
+
+		const sdf_obstacle *obstacle = nullptr;
+		for (auto &o : sdf_obstacles)
+			if (starts_with(node->GetName(), o.prefix))
+				obstacle = &o;
+		if (!obstacle)
+			continue;
+
+		auto mm = object->GetLocalMinMax();
+		mm.mn.y = mm.mx.y - (mm.mx.y - mm.mn.y) * obstacle->top;
+
+		auto world = node->GetComponent<core::Transform>()->GetWorld();
+
+		// edges scaled per axis, the boxes turn about the vertical so they stay orthogonal in field space
+		auto c = world * mm.mn;
+		Vector3 edge[3] = {(world * Vector3(mm.mx.x, mm.mn.y, mm.mn.z) - c) / field_to_world_scale, (world * Vector3(mm.mn.x, mm.mx.y, mm.mn.z) - c) / field_to_world_scale,
+			(world * Vector3(mm.mn.x, mm.mn.y, mm.mx.z) - c) / field_to_world_scale};
+
+		obstacle_box box;
+		box.center = (world * ((mm.mn + mm.mx) * 0.5f) - iso_min) / field_to_world_scale + field_min;
+		for (int i = 0; i < 3; ++i) {
+			auto len = edge[i].Len();
+			box.axis[i] = len > 0.f ? edge[i] / len : Vector3(i == 0, i == 1, i == 2);
+			box.half[i] = len * 0.5f;
+		}
+		boxes.push_back(box);
+
+		if (starts_with(node->GetName(), "maison"))
+			home_boxes.push_back(box);
+	}
+
+	// the particle field box is only the water at rest, obstacles stand on the terrain up to its top and the waves rise
+	// to flood_bounds_max: the grid spans that height
+	auto cells = Vector3(field_size.x, std::max(flood_bounds_max.y, (altitude_min + altitude_max) / 4.f) - field_min.y, field_size.z) / sdf_cell;
+	sdf_bx = (int(cells.x) + sdf_brick - 1) / sdf_brick;
+	sdf_by = (int(cells.y) + sdf_brick - 1) / sdf_brick;
+	sdf_bz = (int(cells.z) + sdf_brick - 1) / sdf_brick;
+
+	sdf_bricks.assign(sdf_bx * sdf_by * sdf_bz, -1);
+	sdf_samples.clear();
+
+	const float brick_radius = sdf_brick * sdf_cell * 0.8660254f; // half diagonal
+
+	std::vector<const obstacle_box *> near_boxes;
+
+	for (int bz = 0; bz < sdf_bz; ++bz)
+		for (int by = 0; by < sdf_by; ++by)
+			for (int bx = 0; bx < sdf_bx; ++bx) {
+				auto brick_min = field_min + Vector3(float(bx), float(by), float(bz)) * (sdf_brick * sdf_cell);
+				auto brick_center = brick_min + Vector3(1, 1, 1) * (sdf_brick * sdf_cell * 0.5f);
+
+				near_boxes.clear();
+				for (auto &box : boxes)
+					if (box.distance(brick_center) < brick_radius + band)
+						near_boxes.push_back(&box);
+
+				if (near_boxes.empty())
+					continue;
+
+				sdf_bricks[bx + (by + bz * sdf_by) * sdf_bx] = int32_t(sdf_samples.size());
+
+				for (int z = 0; z < sdf_brick_samples; ++z)
+					for (int y = 0; y < sdf_brick_samples; ++y)
+						for (int x = 0; x < sdf_brick_samples; ++x) {
+							auto f = brick_min + Vector3(float(x), float(y), float(z)) * sdf_cell;
+
+							float d = 1e9f;
+							for (auto box : near_boxes)
+								d = std::min(d, box->distance(f));
+							sdf_samples.push_back(d);
+						}
+			}
+
+	// every home must read as solid at its center, or the grid misses the obstacles
+	int solid_homes = 0;
+	for (auto &box : home_boxes) {
+		float d;
+		Vector3 grad;
+		solid_homes += scene_sdf_sample(box.center, d, grad) && d < 0.f;
+	}
+
+	log(stringify("scene SDF: %1 obstacle(s), %2 brick(s) stored, %3/%4 home(s) solid").arg(boxes.size()).arg(sdf_samples.size() / (sdf_brick_samples * sdf_brick_samples * sdf_brick_samples))
+			.arg(solid_homes)
+			.arg(home_boxes.size()));
+	__ASSERT__(solid_homes == int(home_boxes.size()));
+}
+
+// trilinear distance and its gradient, false in free space
+bool scene_sdf_sample(const Vector3 &p, float &d, Vector3 &grad) {
+	auto g = (p - field_min) / sdf_cell;
+	if (g.x < 0.f || g.y < 0.f || g.z < 0.f)
+		return false;
+
+	int ix = int(g.x), iy = int(g.y), iz = int(g.z);
+	int bx = ix / sdf_brick, by = iy / sdf_brick, bz = iz / sdf_brick;
+	if (bx >= sdf_bx || by >= sdf_by || bz >= sdf_bz)
+		return false;
+
+	auto first = sdf_bricks[bx + (by + bz * sdf_by) * sdf_bx];
+	if (first < 0)
+		return false;
+
+	int lx = ix - bx * sdf_brick, ly = iy - by * sdf_brick, lz = iz - bz * sdf_brick;
+	float fx = g.x - ix, fy = g.y - iy, fz = g.z - iz;
+
+	static const int sy = sdf_brick_samples, sz = sdf_brick_samples * sdf_brick_samples;
+	auto s = sdf_samples.data() + first + lx + ly * sy + lz * sz;
+
+	float c000 = s[0], c100 = s[1], c010 = s[sy], c110 = s[sy + 1];
+	float c001 = s[sz], c101 = s[sz + 1], c011 = s[sz + sy], c111 = s[sz + sy + 1];
+
+	// interpolate along x, then y, then z
+	float c00 = c000 + (c100 - c000) * fx, c10 = c010 + (c110 - c010) * fx;
+	float c01 = c001 + (c101 - c001) * fx, c11 = c011 + (c111 - c011) * fx;
+	float c0 = c00 + (c10 - c00) * fy, c1 = c01 + (c11 - c01) * fy;
+
+	d = c0 + (c1 - c0) * fz;
+
+	float dx0 = (c100 - c000) + ((c110 - c010) - (c100 - c000)) * fy;
+	float dx1 = (c101 - c001) + ((c111 - c011) - (c101 - c001)) * fy;
+
+	grad.x = (dx0 + (dx1 - dx0) * fz) / sdf_cell;
+	grad.y = ((c10 - c00) + ((c11 - c01) - (c10 - c00)) * fz) / sdf_cell;
+	grad.z = (c1 - c0) / sdf_cell;
+	return true;
+}
+
 void init_water() {
-	water_geo = std::make_shared<render::Geometry>();
 	water_mat = g_plus->GetRenderSystem()->LoadMaterial("water.mat");
 
 	water_field.resize(iso_w * iso_d * iso_h);
+
+	// the last two sample rows/columns are only read as the apron of the last cells
+	water_blocks_x = (iso_w - 2 + water_block_size - 1) / water_block_size;
+
+	const int block_cells = water_block_size * water_block_size * (iso_h - 2);
+	water_block_max_vertices = 3 * (water_block_size + 1) * (water_block_size + 1) * (iso_h - 1);
+	water_block_max_indices = 15 * block_cells;
+	__RASSERT_MSG__(water_block_max_vertices <= 0xffff, "Water block too large for 16 bit indices");
+
+	water_upload_vertices.resize(water_block_max_vertices);
+	water_upload_indices.resize(water_block_max_indices);
+
+	gpu::VertexLayout layout;
+	layout.AddAttribute(gpu::VertexAttribute::Position, 3, gpu::VertexFloat);
+	layout.AddAttribute(gpu::VertexAttribute::Normal, 3, gpu::VertexFloat);
+
+	auto renderer = g_plus->GetRenderer();
+
+	for (int z = 0; z < iso_d - 2; z += water_block_size)
+		for (int x = 0; x < iso_w - 2; x += water_block_size) {
+			water_block b;
+			b.x = x;
+			b.z = z;
+			b.w = std::min(water_block_size, iso_w - 2 - x);
+			b.d = std::min(water_block_size, iso_d - 2 - z);
+			b.lod = WaterEmpty;
+			b.iso = std::make_shared<core::IsoSurface>();
+
+			b.geo = std::make_shared<render::Geometry>();
+			b.geo->materials.push_back(water_mat);
+			b.geo->display_list.push_back({0, 0});
+			b.geo->minmax = MinMax(Vector3::Zero, Vector3(float(b.w), float(iso_h - 2), float(b.d)) * float(iso_scale));
+
+			b.geo->vtx_layout = layout;
+			b.geo->vtx = renderer->NewBuffer();
+			renderer->CreateBuffer(*b.geo->vtx, nullptr, water_block_max_vertices * sizeof(water_vertex), gpu::Buffer::Vertex, gpu::Buffer::Dynamic);
+
+			b.geo->idx_type = gpu::IndexUShort;
+			b.geo->idx = renderer->NewBuffer();
+			renderer->CreateBuffer(*b.geo->idx, nullptr, water_block_max_indices * sizeof(uint16_t), gpu::Buffer::Index, gpu::Buffer::Dynamic);
+
+			water_blocks.push_back(b);
+		}
 }
 
-void particles_to_iso_field() {
+// Surface particles splat the full kernel. Interior particles, told apart by their neighbor count, would only push the
+// density further above the iso threshold, they stamp a box at the interior density instead once the surface is
+// splatted. The box spans a bit more than half the particle spacing so neighboring stamps close the gaps.
+static const float iso_interior_density = 1.25f; // about what full kernels sum to inside the water
+static const float iso_interior_extent = 0.6f; // in particle spacing
+
+int iso_interior_neighbors = 30; // neighbors within cohesion_limit, a particle under the free surface misses a few
+int iso_surface_splats = 0, iso_interior_fills = 0;
+
+void particles_to_iso_field(const sim_snapshot &view) {
+	auto &particles = view.particles;
+	auto &neighbors = view.neighbors;
 	auto count = particles.size();
 
 	std::fill(water_field.begin(), water_field.end(), 0);
 
 	static const int particle_width = 4;
 
+	water_bounds = {iso_w, iso_h, iso_d, -1, -1, -1};
+
+	auto interior = scratch->alloc_array<uint32_t>(count);
+	int interior_count = 0;
+
 	for (uint i = 0; i < count; ++i) {
 		auto &p = particles[i];
 
+		if (i < neighbors.size() && neighbors[i] >= iso_interior_neighbors) {
+			interior[interior_count++] = i;
+			continue;
+		}
+
 		// transform from particle space to iso cell space
 		auto cell_p = (p.pos - field_min) * particle_to_iso_cell;
 
 		// compute particle cell
 		int cell_x = cell_p.x, cell_y = cell_p.y, cell_z = cell_p.z;
 
+		water_bounds.add(cell_x, cell_y, cell_z, particle_width);
+
 		for (int c_x = cell_x - particle_width; c_x <= cell_x + particle_width; ++c_x) {
 			for (int c_z = cell_z - particle_width; c_z <= cell_z + particle_width; ++c_z) {
 				for (int c_y = cell_y - particle_width; c_y <= cell_y + particle_width; ++c_y) {
@@ -404,259 +2306,701 @@ void particles_to_iso_field() {
 		}
 	}
 
-#if 0
-	// field blur
-	uint h_offset = iso_w * iso_d;
+	// interior fill
+	const int fill_x = int(ceilf(particle_to_iso_cell.x * iso_interior_extent));
+	const int fill_y = int(ceilf(particle_to_iso_cell.y * iso_interior_extent));
+	const int fill_z = int(ceilf(particle_to_iso_cell.z * iso_interior_extent));
+
+	for (int k = 0; k < interior_count; ++k) {
+		auto cell_p = (particles[interior[k]].pos - field_min) * particle_to_iso_cell;
+		int cell_x = cell_p.x, cell_y = cell_p.y, cell_z = cell_p.z;
+
+		water_bounds.add(cell_x, cell_y, cell_z, std::max(fill_x, fill_y));
+
+		int x0 = std::max(cell_x - fill_x, 0), x1 = std::min(cell_x + fill_x, iso_w - 1);
+		int z0 = std::max(cell_z - fill_z, 0), z1 = std::min(cell_z + fill_z, iso_d - 1);
+		int y0 = std::max(cell_y - fill_y, 0), y1 = std::min(cell_y + fill_y, iso_h - 1);
+
+		for (int c_y = y0; c_y <= y1; ++c_y)
+			for (int c_z = z0; c_z <= z1; ++c_z) {
+				auto row = water_field.data() + c_z * iso_w + c_y * iso_w * iso_d;
+				for (int c_x = x0; c_x <= x1; ++c_x)
+					row[c_x] = std::max(row[c_x], iso_interior_density);
+			}
+	}
+
+	iso_surface_splats = int(count) - interior_count;
+	iso_interior_fills = interior_count;
+
+	water_bounds.clip();
+}
+
+// out[i] += in[i]
+inline void row_add(float *out, const float *in, int n) {
+	int i = 0;
+#ifdef WAVY_SSE
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(in + i)));
+#endif
+	for (; i < n; ++i)
+		out[i] += in[i];
+}
+
+// out[i] *= k
+inline void row_scale(float *out, float k, int n) {
+	int i = 0;
+#ifdef WAVY_SSE
+	auto k4 = _mm_set1_ps(k);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), k4));
+#endif
+	for (; i < n; ++i)
+		out[i] *= k;
+}
+
+// Separable box smoothing of the occupied part of the iso field. Each pass reads one buffer and writes another, every
+// pass accumulates whole rows and runs in parallel over y slabs, the X pass sums the row shifted by each offset.
+void smooth_iso_field(int radius) {
+	if (radius <= 0 || water_bounds.empty())
+		return;
+
+	auto r = water_bounds;
+	r.add(r.x0, r.y0, r.z0, radius);
+	r.add(r.x1, r.y1, r.z1, radius);
+	r.clip();
+
+	int rw = r.x1 - r.x0 + 1, rh = r.y1 - r.y0 + 1, rd = r.z1 - r.z0 + 1;
+
+	auto a = scratch->alloc_array<float>(rw * rh * rd); // region local, x -> z -> y
+	auto b = scratch->alloc_array<float>(rw * rh * rd);
+
+	const int layer = iso_w * iso_d;
+
+	// X pass: water_field -> a
+	workers.parallel_for(0, rh, 1, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y)
+			for (int z = 0; z < rd; ++z) {
+				auto in = water_field.data() + (r.y0 + y) * layer + (r.z0 + z) * iso_w;
+				auto out = a + (y * rd + z) * rw;
+				memset(out, 0, rw * sizeof(float));
+
+				// out[x] += in[r.x0 + x + k] over the x whose sample lies inside the field
+				for (int k = -radius; k <= radius; ++k) {
+					int shift = r.x0 + k;
+					int x0 = std::max(-shift, 0), x1 = std::min(iso_w - shift, rw);
+					if (x0 < x1)
+						row_add(out + x0, in + shift + x0, x1 - x0);
+				}
+			}
+	});
+
+	// Z pass: a -> b
+	workers.parallel_for(0, rh, 1, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y)
+			for (int z = 0; z < rd; ++z) {
+				auto out = b + (y * rd + z) * rw;
+				memset(out, 0, rw * sizeof(float));
+
+				for (int k = std::max(z - radius, 0); k <= std::min(z + radius, rd - 1); ++k)
+					row_add(out, a + (y * rd + k) * rw, rw);
+			}
+	});
 
-	// X pass
-	for (uint y = 0; y < iso_h; ++y) {
-		float *p_data = water_field.c_ptr() + (h_offset * y) + 1;
+	// Y pass and normalization: b -> water_field
+	const float k_norm = 1.f / float((2 * radius + 1) * (2 * radius + 1) * (2 * radius + 1));
 
-		for (uint z = 0; z < iso_d; ++z) {
-			for (uint x = 1; x < iso_w - 1; ++x)
-				p_data[x] = (p_data[x - 1] + p_data[x] * 2 + p_data[x + 1]) / 4;
-			p_data += iso_w;
+	workers.parallel_for(0, rh, 1, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y)
+			for (int z = 0; z < rd; ++z) {
+				auto out = water_field.data() + (r.y0 + y) * layer + (r.z0 + z) * iso_w + r.x0;
+				memset(out, 0, rw * sizeof(float));
+
+				for (int k = std::max(y - radius, 0); k <= std::min(y + radius, rh - 1); ++k)
+					row_add(out, b + (k * rd + z) * rw, rw);
+
+				row_scale(out, k_norm, rw);
+			}
+	});
+}
+
+int water_block_lod(int bx, int bz) {
+	if (bx < 0 || bz < 0 || bx >= water_blocks_x || bz * water_blocks_x >= int(water_blocks.size()))
+		return WaterEmpty;
+	return water_blocks[bx + bz * water_blocks_x].lod;
+}
+
+// Replace the odd samples of a line of the block field by the mean of their even neighbors, the full resolution
+// contour along the line then crosses where the half resolution one does. Blocks start on even cells so local and
+// global parity agree.
+static void conform_water_line(float *f, int stride, int n) {
+	for (int i = 1; i < n; i += 2)
+		f[i * stride] = i + 1 < n ? (f[(i - 1) * stride] + f[(i + 1) * stride]) * 0.5f : f[(i - 1) * stride];
+}
+
+// face at local x (or z) index, conformed along z (or x) then y
+static void conform_water_face(float *f, int along_stride, int along_n, int y_stride, int y_n) {
+	for (int y = 0; y < y_n; y += 2)
+		conform_water_line(f + y * y_stride, along_stride, along_n);
+	for (int a = 0; a < along_n; ++a)
+		conform_water_line(f + a * along_stride, y_stride, y_n);
+}
+
+// stage the block iso surface in the buffer layout and upload the used range only
+void upload_water_block(water_block &b) {
+	const auto &vtxs = b.iso->vtxs;
+	const auto &tris = b.iso->tris;
+
+	const int vtx_count = int(vtxs.size()), idx_count = int(tris.size());
+	__ASSERT__(vtx_count <= water_block_max_vertices && idx_count <= water_block_max_indices);
+
+	for (int i = 0; i < vtx_count; ++i)
+		water_upload_vertices[i] = {vtxs[i].p, vtxs[i].n};
+	for (int i = 0; i < idx_count; ++i)
+		water_upload_indices[i] = uint16_t(tris[i]);
+
+	auto renderer = g_plus->GetRenderer();
+	if (idx_count) {
+		renderer->UpdateBuffer(*b.geo->vtx, water_upload_vertices.data(), 0, vtx_count * sizeof(water_vertex));
+		renderer->UpdateBuffer(*b.geo->idx, water_upload_indices.data(), 0, idx_count * sizeof(uint16_t));
+	}
+	b.geo->display_list[0].idx_count = uint32_t(idx_count);
+}
+
+void polygonise_water_block(water_block &b) {
+	int step = b.lod == WaterHalf ? 2 : 1;
+
+	int cw = b.w / step, cd = b.d / step, ch = (iso_h - 2) / step; // cells
+	int sw = cw + 2, sd = cd + 2, sh = ch + 2; // samples, with the apron
+
+	auto block_field = scratch->alloc_array<float>(sw * sd * sh);
+
+	// point sample so coarse samples sit exactly on the full resolution lattice
+	auto out = block_field;
+	for (int y = 0; y < sh; ++y)
+		for (int z = 0; z < sd; ++z) {
+			auto in = water_field.data() + std::min(y * step, iso_h - 1) * iso_w * iso_d + std::min(b.z + z * step, iso_d - 1) * iso_w;
+			for (int x = 0; x < sw; ++x)
+				*out++ = in[std::min(b.x + x * step, iso_w - 1)];
 		}
+
+	if (b.lod == WaterFull) {
+		const int bx = b.x / water_block_size, bz = b.z / water_block_size;
+		const int layer = sw * sd;
+
+		if (water_block_lod(bx - 1, bz) == WaterHalf)
+			conform_water_face(block_field, sw, sd, layer, sh);
+		if (water_block_lod(bx + 1, bz) == WaterHalf)
+			conform_water_face(block_field + cw, sw, sd, layer, sh);
+		if (water_block_lod(bx, bz - 1) == WaterHalf)
+			conform_water_face(block_field, 1, sw, layer, sh);
+		if (water_block_lod(bx, bz + 1) == WaterHalf)
+			conform_water_face(block_field + cd * sw, 1, sw, layer, sh);
+
+		// corner edges shared with a diagonal neighbor only
+		const int corners[4][3] = {{-1, -1, 0}, {1, -1, cw}, {-1, 1, cd * sw}, {1, 1, cd * sw + cw}};
+		for (auto &c : corners)
+			if (water_block_lod(bx + c[0], bz + c[1]) == WaterHalf)
+				conform_water_line(block_field + c[2], layer, sh);
+	}
+
+	b.iso->Clear();
+	PolygoniseIsoSurface(cw, ch, cd, block_field, 1, *b.iso, iso_unit * float(step));
+	upload_water_block(b);
+
+	b.origin = iso_min + Vector3(float(b.x), 0, float(b.z)) * float(iso_scale);
+
+	//	log(stringify("%1 indexes").arg(b.geo->display_list[0].idx_count));
+}
+
+/* CAMERA */
+
+static const int screen_width = 1280, screen_height = 720; // render window, mouse coordinates are in its pixels
+
+// the matrices the scene renders the camera with, culling, picking and debug draws derive from them
+struct camera_view {
+	Matrix4 world, view;
+	Matrix44 projection, view_projection;
+};
+
+camera_view get_camera_view(core::Node &node) {
+	camera_view v;
+	v.world = node.GetComponent<core::Transform>()->GetWorld();
+	v.view = v.world.InversedFast();
+	v.projection = node.GetComponent<core::Camera>()->GetProjectionMatrix(g_plus->GetRenderSystem()->GetAspectRatio());
+	v.view_projection = v.projection * Matrix44(v.view);
+	return v;
+}
+
+// world direction through a window pixel, origin bottom-left
+Vector3 camera_ray(const camera_view &c, float px, float py) {
+	auto far_point = c.view_projection.Inversed() * Vector4(px / screen_width * 2.f - 1.f, py / screen_height * 2.f - 1.f, 1.f, 1.f);
+	return (Vector3(far_point.x, far_point.y, far_point.z) / far_point.w - c.world.GetTranslation()).Normalized();
+}
+
+// Blocks are culled before any meshing work, first against the camera frustum with the whole iso height, then against
+// the terrain once their surface height is known: a block is hidden when the lines of sight to the corners and center
+// of its surface all pass under the heightmap. Terrain within the block does not count, water may sit in a valley of it.
+struct water_camera {
+	Vector3 eye;
+	FrustumPlanes frustum;
+};
+
+water_camera make_water_camera(const camera_view &view) {
+	water_camera c;
+	c.eye = view.world.GetTranslation();
+	c.frustum = BuildFrustumPlanes(view.view_projection);
+	return c;
+}
+
+bool water_block_in_frustum(const water_camera &c, const Vector3 &mn, const Vector3 &mx) { return ClassifyMinMax(c.frustum, MinMax(mn, mx)) != Outside; }
+
+static const int water_occlusion_steps = 16; // height samples along a line of sight
+static const float water_occlusion_margin = 1.f; // terrain must rise this far above the line to hide it
+
+bool water_point_visible(const water_camera &c, const Vector3 &p, const Vector3 &mn, const Vector3 &mx) {
+	for (int s = 1; s < water_occlusion_steps; ++s) {
+		auto q = c.eye + (p - c.eye) * (float(s) / water_occlusion_steps);
+		if (q.x < iso_min.x || q.x > iso_max.x || q.z < iso_min.z || q.z > iso_max.z)
+			continue; // no terrain outside of the map
+		if (q.x >= mn.x && q.x <= mx.x && q.z >= mn.z && q.z <= mx.z)
+			continue;
+
+		if (particle_sample_height(world_to_field(q)) > q.y + water_occlusion_margin)
+			return false;
 	}
+	return true;
+}
+
+bool water_block_occluded(const water_camera &c, const Vector3 &mn, const Vector3 &mx) {
+	const Vector3 points[5] = {Vector3(mn.x, mx.y, mn.z), Vector3(mx.x, mx.y, mn.z), Vector3(mn.x, mx.y, mx.z), Vector3(mx.x, mx.y, mx.z),
+		(mn + mx) * 0.5f + Vector3(0, (mx.y - mn.y) * 0.5f, 0)};
+
+	for (auto &p : points)
+		if (water_point_visible(c, p, mn, mx))
+			return false;
+	return true;
+}
+
+bool water_culling = true;
+int water_frustum_culled = 0, water_occlusion_culled = 0;
+
+void water_to_render_geometry(const water_camera &view) {
+	const int layer = iso_w * iso_d;
+
+	water_frustum_culled = water_occlusion_culled = 0;
+
+	for (auto &b : water_blocks) {
+		auto block_min = iso_min + Vector3(float(b.x), 0, float(b.z)) * float(iso_scale);
+		auto block_max = iso_min + Vector3(float(b.x + b.w), float(iso_h - 1), float(b.z + b.d)) * float(iso_scale);
+
+		if (water_culling && !water_block_in_frustum(view, block_min, block_max)) {
+			b.lod = WaterEmpty;
+			++water_frustum_culled;
+			continue;
+		}
+
+		// surface height range over the block columns, -1 for a dry column
+		int top_min = iso_h, top_max = -1;
+
+		for (int z = b.z; z <= b.z + b.d; ++z)
+			for (int x = b.x; x <= b.x + b.w; ++x) {
+				auto column = water_field.data() + x + z * iso_w;
+
+				int top = iso_h - 1;
+				while (top >= 0 && column[top * layer] < 1.f)
+					--top;
+
+				top_min = std::min(top_min, top);
+				top_max = std::max(top_max, top);
+			}
+
+		if (top_max < 0) {
+			b.lod = WaterEmpty;
+			continue;
+		}
+
+		block_max.y = iso_min.y + (top_max + 1) * float(iso_scale);
+		if (water_culling && water_block_occluded(view, block_min, block_max)) {
+			b.lod = WaterEmpty;
+			++water_occlusion_culled;
+			continue;
+		}
+
+		auto center = iso_min + Vector3(b.x + b.w * 0.5f, float(top_max), b.z + b.d * 0.5f) * float(iso_scale);
+
+		bool is_far = Vector3::Dist(center, view.eye) > water_lod_distance;
+		bool is_flat = top_min >= 0 && top_max - top_min <= 1;
+
+		b.lod = (is_far || is_flat) && !(b.w & 1) && !(b.d & 1) ? WaterHalf : WaterFull;
+	}
+
+	// every level is known before meshing, full resolution blocks conform to their half resolution neighbors
+	for (auto &b : water_blocks)
+		if (b.lod != WaterEmpty)
+			polygonise_water_block(b);
+}
+
+void draw_water(core::RenderableSystem &renderable_system) {
+	for (auto &b : water_blocks)
+		if (b.lod != WaterEmpty)
+			renderable_system.DrawGeometry(b.geo, Matrix4::TranslationMatrix(b.origin));
+}
+
+//
+enum debug_particle_color { DebugColorNone, DebugColorVelocity, DebugColorNeighbors, DebugColorSleep };
+
+static const char *debug_particle_color_names[] = {"None", "Velocity", "Neighbor count", "Sleep state"};
+
+int debug_particle_color_mode = DebugColorNone;
+
+// Lines are accumulated into persistent arrays and handed to the overlay in one pass, the ground normals never change
+// so they are built once.
+struct debug_line_buffer {
+	std::vector<Vector3> vtx; // 2 per line
+	std::vector<Color> col;
+
+	void clear() {
+		vtx.clear();
+		col.clear();
+	}
+
+	void push(const Vector3 &a, const Vector3 &b, const Color &ca, const Color &cb) {
+		vtx.push_back(a);
+		vtx.push_back(b);
+		col.push_back(ca);
+		col.push_back(cb);
+	}
+
+	// a single draw call, after the scene has rendered with the same camera
+	void draw(render::RenderSystem &render_system, const camera_view &camera) const {
+		if (vtx.empty())
+			return;
+		render_system.SetView(camera.view, camera.projection);
+		render_system.DrawLine(uint(vtx.size()), vtx.data(), col.data());
+	}
+};
+
+debug_line_buffer debug_particle_lines, debug_ground_lines;
+
+Color debug_ramp(float t) {
+	t = math::Clamp(t, 0.f, 1.f);
+	return Color(t, 0.2f, 1.f - t);
+}
+
+void debug_particle_field(const sim_snapshot &view) {
+	auto &particles = view.particles;
+	auto &particle_neighbors = view.neighbors;
+	auto count = particles.size();
+
+	const auto to_world_scale = particle_to_iso_cell * iso_scale;
+	const Vector3 half_cross(0, 0, 0.1f);
+
+	debug_particle_lines.clear();
+	for (int i = 0; i < count; ++i) {
+		auto &p = particles[i];
+
+		Color c = Color::White;
+		if (debug_particle_color_mode == DebugColorVelocity)
+			c = debug_ramp(p.vel.Len() * 4.f);
+		else if (debug_particle_color_mode == DebugColorNeighbors && i < particle_neighbors.size())
+			c = debug_ramp(particle_neighbors[i] / 32.f);
+		else if (debug_particle_color_mode == DebugColorSleep)
+			c = i < view.awake.size() && view.awake[i] ? Color::Red : Color::Blue;
+
+		auto w = (p.pos - field_min) * to_world_scale + iso_min;
+		debug_particle_lines.push(w - half_cross, w + half_cross, c, c);
+	}
+
+	if (debug_ground_lines.vtx.empty()) {
+		float h;
+		Vector3 n;
+
+		auto scale = Vector3(212, 0, 212) / field_size;
+
+		for (float x = field_min.x; x < field_max.x; x += field_res.x / 2.f) {
+			for (float z = field_min.z; z < field_max.z; z += field_res.z / 2.f) {
+				particle_sample_ground(Vector3(x, 0, z), n, h);
+				n *= 4.f;
+
+				Vector3 base(x * scale.x, h, z * scale.z);
+				debug_ground_lines.push(base, base + n, Color::Red, Color::Yellow);
+			}
+		}
+	}
+}
+
+void draw_debug_particle_field(render::RenderSystem &render_system, const camera_view &camera) {
+	debug_particle_lines.draw(render_system, camera);
+	debug_ground_lines.draw(render_system, camera);
+}
+
+core::sScene scn;
+core::sNode sunlight, backlight;
+core::sNode light_cycle_control;
+core::sNode cam;
+
+// game flow states, see GAME STATE MACHINE
+enum game_state_id {
+	StateNone = -1,
+	StateMainMenuIdle,
+	StateMainMenuOut,
+	StateMainMenuReveal,
+	StateDayPrelude,
+	StatePlaceTotems,
+	StateIncoming,
+	StateRunWave,
+	StateNightCycle,
+	StateGameOver,
+	StateVictory,
+	StateCount
+};
+
+input::sDevice mouse, keyboard;
+
+std::shared_ptr<core::SimpleGraphicSceneOverlay> gfx, ui_gfx;
+
+std::shared_ptr<core::RenderableSystem> renderable_system;
+
+/* USER INTERFACE */
+
+// HUD images are packed once into a single atlas texture, the HUD is then a run of quads sharing one texture which
+// the 2D renderer submits as a single batch. Full screen images are resolved to texture handles once.
+enum hud_image_id { HudCounter0, HudCounter10, HudCounter30, HudCounter50, HudCounter70, HudCounter100, HudTokenClear, HudTokenDead, HudTotem, HudImageCount };
+
+static const char *hud_image_paths[HudImageCount] = {"Peon counter 0.png", "Peon counter 10-01.png", "Peon counter 30-11.png", "Peon counter 50-31.png", "Peon counter 70-51.png", "Peon counter 100-71.png", "Peon Token Clear.png", "Peon Token Dead.png", "Totem.png"};
+
+struct hud_image {
+	float w, h; // in pixels
+	float u0, v0, u1, v1; // in atlas
+};
+
+enum screen_image_id { ScreenTitleBg, ScreenTitle, ScreenGameOver, ScreenVictory, ScreenDeads, ScreenNoDeads, ScreenPointing1, ScreenPointing2, ScreenImageCount };
+
+static const char *screen_image_paths[ScreenImageCount] = {"title_bg.png", "title.png", "Game over 001.jpg", "Victory.jpg", "Deads of the day.jpg", "fuck.jpg", "Pointage de doigt 01.jpg", "Pointage de doigt 02.jpg"};
 
-	// Y pass
-	for (uint z = 0; z < iso_d; ++z) {
-		float *p_data = water_field.c_ptr() + (iso_w * z) + h_offset;
+static const char *ui_font = "Carton_Six.ttf";
 
-		for (uint y = 1; y < iso_h - 1; ++y) {
-			for (uint x = 0; x < iso_w; ++x)
-				p_data[x] = (p_data[int(x) - int(h_offset)] + p_data[x] * 2 + p_data[x + h_offset]) / 4;
-			p_data += h_offset;
-		}
-	}
+gpu::sTexture hud_atlas;
+std::array<hud_image, HudImageCount> hud_images;
+std::array<gpu::sTexture, ScreenImageCount> screen_images;
 
-	// Z pass
-	for (uint y = 0; y < iso_h; ++y) {
-		float *p_data = water_field.c_ptr() + (h_offset * y) + iso_w;
+// number formatting only happens when the displayed value changes
+struct ui_text {
+	int value = -1;
+	std::string text;
 
-		for (uint z = 1; z < iso_d - 1; ++z) {
-			for (uint x = 0; x < iso_w; ++x)
-				p_data[x] = (p_data[int(x) - int(iso_w)] + p_data[x] * 2 + p_data[x + iso_w]) / 4;
-			p_data += iso_w;
+	const char *get(const char *format, int v) {
+		if (v != value || text.empty()) {
+			value = v;
+			text = stringify(format).arg(v);
 		}
+		return text.c_str();
 	}
-#endif
-}
+};
 
-void water_to_render_geometry() {
-	water_iso->Clear();
-	PolygoniseIsoSurfaceToRenderGeometry(g_plus->GetRenderSystem(), water_geo, water_mat, iso_w - 2, iso_h - 2, iso_d - 2, water_field.data(), 1, water_iso, iso_unit);
+void init_ui() {
+	static const int atlas_size = 1024, padding = 2;
 
-	//	log(stringify("%1 indexes").arg(water_geo->display_list[0].idx_count));
-}
+	auto renderer = g_plus->GetRenderer();
 
-//
-void debug_particle_field(core::SimpleGraphicSceneOverlay &gfx) {
-	//	gfx.SetDepthTest(false);
+	Picture atlas(atlas_size, atlas_size, PictureRGBA8);
+	memset(atlas.GetData(), 0, atlas_size * atlas_size * 4);
 
-	auto count = particles.size();
-	for (int i = 0; i < count; ++i) {
-		auto p = (particles[i].pos - field_min) * particle_to_iso_cell * iso_scale + iso_min;
-		draw_cross(gfx, p);
-	}
+	// shelf packing, images are few and fixed
+	int x = 0, y = 0, shelf_h = 0;
 
-	float h;
-	Vector3 n;
+	for (int i = 0; i < HudImageCount; ++i) {
+		Picture pic;
+		bool loaded = LoadPicture(pic, hud_image_paths[i]);
+		__RASSERT_MSG__(loaded, "Missing HUD image");
+		pic.Convert(PictureRGBA8);
 
-	auto scale = Vector3(212, 0, 212) / field_size;
+		int w = pic.GetWidth(), h = pic.GetHeight();
 
-	for (float x = field_min.x; x < field_max.x; x += field_res.x / 2.f) {
-		for (float z = field_min.z; z < field_max.z; z += field_res.z / 2.f) {
-			particle_sample_ground(Vector3(x, 0, z), n, h);
-			n *= 4.f;
-			gfx.Line(x * scale.x, h, z * scale.z, x * scale.x + n.x, h + n.y, z * scale.z + n.z, Color::Red, Color::Yellow);
+		if (x + w > atlas_size) {
+			x = 0;
+			y += shelf_h + padding;
+			shelf_h = 0;
 		}
-	}
-
-	//	gfx.SetDepthTest(true);
-}
+		__RASSERT_MSG__(y + h <= atlas_size, "HUD atlas overflow");
 
-//
-bool fast_background_simulation = false;
+		for (int row = 0; row < h; ++row)
+			memcpy(atlas.GetData() + ((y + row) * atlas_size + x) * 4, pic.GetData() + row * w * 4, w * 4);
 
-core::sScene scn;
-core::sNode sunlight, backlight;
-core::sNode light_cycle_control;
-core::sNode cam;
+		hud_images[i] = {float(w), float(h), float(x) / atlas_size, float(y) / atlas_size, float(x + w) / atlas_size, float(y + h) / atlas_size};
 
-std::function<bool()> game_state, next_game_state;
+		x += w + padding;
+		shelf_h = std::max(shelf_h, h);
+	}
 
-input::sDevice mouse, keyboard;
+	hud_atlas = renderer->NewTexture("@ui/hud_atlas");
+	renderer->CreateTexture(*hud_atlas, atlas);
 
-std::shared_ptr<core::SimpleGraphicSceneOverlay> gfx, ui_gfx;
+	for (int i = 0; i < ScreenImageCount; ++i)
+		screen_images[i] = g_plus->GetRenderSystem()->LoadTexture(screen_image_paths[i]);
+}
 
-std::shared_ptr<core::RenderableSystem> renderable_system;
+void draw_hud_image(hud_image_id id, float x, float y, float scale) {
+	auto &img = hud_images[id];
+	float x1 = x + img.w * scale, y1 = y + img.h * scale;
+	g_plus->Quad2D(x, y, x, y1, x1, y1, x1, y, Color::White, Color::White, Color::White, Color::White, hud_atlas, img.u0, img.v1, img.u1, img.v0);
+}
 
-bool main_menu_idle();
-bool day_prelude();
+void draw_screen_image(screen_image_id id, float x, float y, float scale) { g_plus->Texture2D(x, y, scale, screen_images[id]); }
 
 // GAME STATE
 int current_day = 1;
 
 float get_health() {
-	auto health = get_homes_energy() * 100.f / total_homes_energy;
+	auto health = sim_view->homes_energy * 100.f / total_homes_energy;
 	if (health < 0)
 		health = 0;
 	return health;
 }
 
+// the game keeps its own totems for drawing, the simulation gets a copy
+void clear_totems() {
+	active_totems = 0;
+	simulation.send(SimClearTotems);
+}
+
+void set_take_damage(bool on) {
+	static bool sent = false;
+	if (on != sent)
+		simulation.send(SimTakeDamage, on ? 1.f : 0.f);
+	sent = on;
+}
+
 void draw_game_state_ui() {
 	float health = get_health();
 
-	const char *count_bg_path = "Peon counter 0.png";
+	auto count_bg = HudCounter0;
 
 	if (health > 70)
-		count_bg_path = "Peon counter 100-71.png";
+		count_bg = HudCounter100;
 	else if (health > 50)
-		count_bg_path = "Peon counter 70-51.png";
+		count_bg = HudCounter70;
 	else if (health > 30)
-		count_bg_path = "Peon counter 50-31.png";
+		count_bg = HudCounter50;
 	else if (health > 10)
-		count_bg_path = "Peon counter 30-11.png";
+		count_bg = HudCounter30;
 	else if (health > 0)
-		count_bg_path = "Peon counter 10-01.png";
-
-	g_plus->Image2D(40, 550, 0.75f, count_bg_path);
-	g_plus->Image2D(70, 570, 0.75f, health > 0.f ? "Peon Token Clear.png" : "Peon Token Dead.png");
+		count_bg = HudCounter10;
 
-	g_plus->Text2D(200, 600, std::to_string(int(health)).c_str(), 90.f, Color::White, "Carton_Six.ttf");
+	// all quads sample the HUD atlas so they go out in a single batch
+	draw_hud_image(count_bg, 40, 550, 0.75f);
+	draw_hud_image(health > 0.f ? HudTokenClear : HudTokenDead, 70, 570, 0.75f);
 
 	for (int i = 0; i < (3 - active_totems); ++i)
-		g_plus->Image2D(30 + i * 58, 70, 1.f, "Totem.png");
+		draw_hud_image(HudTotem, 30 + i * 58, 70, 1.f);
+
+	static ui_text health_text;
+	g_plus->Text2D(200, 600, health_text.get("%1", int(health)), 90.f, Color::White, ui_font);
 }
 
 //
-bool night_cycle() {
-	active_totems = 0;
+static const float night_cycle_speed = 4.5f; // sun rotation, radians per second
 
-	draw_game_state_ui();
+float night_cycle_start;
 
+void night_cycle_enter() {
+	clear_totems();
+	night_cycle_start = light_cycle_control->GetComponent<core::Transform>()->GetRotation().x;
+}
+
+game_state_id night_cycle(float t) {
 	auto trs = light_cycle_control->GetComponent<core::Transform>();
 	auto rot = trs->GetRotation();
 
-	apply_wave(0.001f);
-
-	rot.x += 0.075f;
+	rot.x = night_cycle_start + night_cycle_speed * t;
 	if (rot.x > units::Deg(360.f)) {
 		rot.x = 0.f;
 		trs->SetRotation(rot);
-		next_game_state = day_prelude;
 		++current_day;
-		return true;
+		return StateDayPrelude;
 	}
 
 	trs->SetRotation(rot);
 
-	return false;
+	return StateNone;
 }
 
 //
-int game_over_delay = 60;
-
-bool game_over() {
-	g_plus->Image2D(0, 0, 1.f, "Game over 001.jpg");
+static const float end_screen_duration = 1.f;
 
-	if (--game_over_delay == 0) {
-		next_game_state = main_menu_idle;
-		game_over_delay = 60;
-		reset_homes_energy();
-		return true;
-	}
-	return false;
+game_state_id game_over(float t) {
+	draw_screen_image(ScreenGameOver, 0, 0, 1.f);
+	return t < end_screen_duration ? StateNone : StateMainMenuIdle;
 }
 
-int victory_delay = 60;
-
-bool victory() {
-	g_plus->Image2D(0, 0, 1.f, "Victory.jpg");
-
-	if (--game_over_delay == 0) {
-		next_game_state = main_menu_idle;
-		victory_delay = 60;
-		reset_homes_energy();
-		return true;
-	}
-	return false;
+game_state_id victory(float t) {
+	draw_screen_image(ScreenVictory, 0, 0, 1.f);
+	return t < end_screen_duration ? StateNone : StateMainMenuIdle;
 }
 
 //
-int force_timeout = 32;
-int flood_duration = 0;
+static const float flood_damage_time = 2.5f, flood_report_time = 2.9f, flood_end_time = 3.85f;
 
 float last_wave_health;
 
-bool run_wave() {
+game_state_id run_wave(float t) {
 	auto health = get_health();
 
-	draw_game_state_ui();
-
-	take_damage = flood_duration < 150;
-	log(stringify("damage_t: %1").arg(flood_duration));
-
-	//	if (--force_timeout > 0)
-	//		apply_wave(-0.005f);
+	if (t >= flood_damage_time)
+		set_take_damage(false);
+	//	log(stringify("damage_t: %1").arg(t));
 
-	if (flood_duration > 175) {
+	if (t > flood_report_time) {
 		auto death_count = int(last_wave_health) - int(health);
 
 		if (death_count > 0) {
-			g_plus->Image2D(0, 0, 1.f, "Deads of the day.jpg");
-			g_plus->Text2D(300, 600, stringify("%1 lost their lives today").arg(death_count), 96.f, Color::White, "Carton_Six.ttf");
-		}
-		else {
-			g_plus->Image2D(0, 0, 1.f, "fuck.jpg");
-		}
-	}
+			draw_screen_image(ScreenDeads, 0, 0, 1.f);
 
-	if (flood_duration > 230) {
-		if (!health) {
-			next_game_state = game_over;
+			static ui_text death_text;
+			g_plus->Text2D(300, 600, death_text.get("%1 lost their lives today", death_count), 96.f, Color::White, ui_font);
 		}
 		else {
-			next_game_state = current_day < 3 ? night_cycle : victory;
+			draw_screen_image(ScreenNoDeads, 0, 0, 1.f);
 		}
+	}
 
-		flood_duration = 0;
-		force_timeout = 32;
-		return true;
+	if (t > flood_end_time) {
+		if (!health)
+			return StateGameOver;
+		return current_day < 3 ? StateNightCycle : StateVictory;
 	}
 
-	++flood_duration;
-	return false;
+	return StateNone;
+}
+
+void run_wave_enter() {
+	simulation.send(SimResetImpacts);
+	set_take_damage(true);
 }
 
+void run_wave_exit() { set_take_damage(false); }
+
 //
-int incoming_t = 0;
 
 void display_totem_instructions() {
-	g_plus->Text2D(220, 70, "Place 3 totems to counter the flood and protect your people!", 32.f, Color::White, "Carton_Six.ttf");
+	g_plus->Text2D(220, 70, "Place 3 totems to counter the flood and protect your people!", 32.f, Color::White, ui_font);
 }
 
-bool incoming() {
-	apply_wave(0.005f);
+game_state_id incoming(float t) {
 	display_totem_instructions();
 
-	if (incoming_t < 20) // small timing
+	if (t < 0.33f) // small timing
 		;
-	else if (incoming_t < 40)
-		g_plus->Image2D(0, 0, 1.f, "Pointage de doigt 01.jpg");
-	else if (incoming_t < 60)
-		g_plus->Image2D(0, 0, 1.f, "Pointage de doigt 02.jpg");
-	else if (incoming_t < 70)
+	else if (t < 0.67f)
+		draw_screen_image(ScreenPointing1, 0, 0, 1.f);
+	else if (t < 1.f)
+		draw_screen_image(ScreenPointing2, 0, 0, 1.f);
+	else if (t < 1.17f)
 		;
-	else {
-		next_game_state = run_wave;
-		incoming_t = 0;
-		return true;
-	}
+	else
+		return StateRunWave;
 
-	++incoming_t;
-	return false;
+	return StateNone;
 }
 
 //
@@ -680,132 +3024,594 @@ bool is_totem_position_valid(const Vector3 &wp) {
 	return true;
 }
 
-bool place_totems() {
-	draw_game_state_ui();
+/* TERRAIN PICKING */
+
+// ray-march the baked heightmap instead of picking against the whole scene
+bool pick_terrain(float mx, float my, Vector3 &wp) {
+	auto camera = get_camera_view(*cam);
+
+	auto o = camera.world.GetTranslation();
+	auto d = camera_ray(camera, mx, my);
+
+	// start where the ray enters the terrain altitude range
+	const float ground_top = altitude_min + altitude_max;
+
+	float t = 0;
+	if (o.y > ground_top) {
+		if (d.y >= 0)
+			return false;
+		t = (o.y - ground_top) / -d.y;
+	}
+
+	static const float min_step = 0.25f;
+	static const int bisect_steps = 8;
+
+	float t_prev = t;
+	for (;;) {
+		auto p = o + d * t;
+		if (p.x < iso_min.x || p.x > iso_max.x || p.z < iso_min.z || p.z > iso_max.z)
+			return false;
+
+		float gap = p.y - particle_sample_height(world_to_field(p));
+		if (gap <= 0)
+			break;
+		if (d.y >= 0 && p.y > ground_top)
+			return false;
+
+		t_prev = t;
+		t += math::Max(min_step, gap * 0.5f);
+	}
+
+	// refine the crossing between the last sample above ground and the first one below
+	float t_above = t_prev, t_below = t;
+	for (int i = 0; i < bisect_steps; ++i) {
+		float t_mid = (t_above + t_below) * 0.5f;
+		auto p = o + d * t_mid;
+		if (p.y > particle_sample_height(world_to_field(p)))
+			t_above = t_mid;
+		else
+			t_below = t_mid;
+	}
+
+	wp = o + d * t_below;
+	wp.y = particle_sample_height(world_to_field(wp));
+	return true;
+}
+
+// the terrain is static, a pick only changes with the mouse or the camera
+struct terrain_pick {
+	float mx = -1, my = -1;
+	Vector3 cam_pos = Vector3::Zero, cam_rot = Vector3::Zero;
+
+	bool hit = false, valid = false;
+	Vector3 wp, n;
+};
+
+terrain_pick totem_pick;
+
+const terrain_pick &update_totem_pick(float mx, float my) {
+	auto trs = cam->GetComponent<core::Transform>();
+	auto cam_pos = trs->GetPosition(), cam_rot = trs->GetRotation();
+
+	auto &pick = totem_pick;
+	if (mx == pick.mx && my == pick.my && Vector3::Dist2(cam_pos, pick.cam_pos) == 0 && Vector3::Dist2(cam_rot, pick.cam_rot) == 0)
+		return pick;
+
+	pick.mx = mx;
+	pick.my = my;
+	pick.cam_pos = cam_pos;
+	pick.cam_rot = cam_rot;
+
+	pick.hit = pick_terrain(mx, my, pick.wp);
+	if (pick.hit) {
+		float h;
+		particle_sample_ground(world_to_field(pick.wp), pick.n, h);
+		pick.valid = is_totem_position_valid(pick.wp);
+	}
+	return pick;
+}
 
-	apply_wave(0.005f);
+game_state_id place_totems(float t) {
 	display_totem_instructions();
 
 	//
 	float mx, my;
 	g_plus->GetMousePos(&mx, &my);
 
-	Vector3 wp;
-	//	if (scene_picking->Prepare(*scn, false, true).get())
-	if (scene_picking->PickWorld(*scn, mx, my, wp)) {
-		auto fp = world_to_field(wp);
+	auto &pick = update_totem_pick(mx, my);
 
-		float h;
-		Vector3 n;
-		particle_sample_ground(fp, n, h);
-
-		//
-		bool is_totem_pos_valid = is_totem_position_valid(wp);
+	if (pick.hit) {
+		auto &wp = pick.wp, &n = pick.n;
 
 		Vector3 disk_wp = wp + n;
 		auto disk_matrix = Matrix4::TransformationMatrix(disk_wp, Matrix3::LookAt(n) * Matrix3::RotationMatrixXAxis(units::Deg(90.f)));
 
 		gfx->Line(disk_wp.x, disk_wp.y, disk_wp.z, disk_wp.x + n.x * 5.f, disk_wp.y + n.y * 5.f, disk_wp.z + n.z * 5.f, Color::White, Color::Green);
 
-		renderable_system->DrawGeometry(is_totem_pos_valid ? green_disk : red_disk, disk_matrix);
+		renderable_system->DrawGeometry(pick.valid ? green_disk : red_disk, disk_matrix);
 
-		if (is_totem_pos_valid)
+		if (pick.valid)
 			if (mouse->WasButtonPressed(input::Device::Button0)) {
 				totems[active_totems].pos = wp;
 				++active_totems;
+				simulation.send(SimPlaceTotem, 0.f, wp);
 			}
 	}
 
 	//
-	if (active_totems == 3) { // (keyboard->WasPressed(input::Device::KeySpace)) {
-		last_wave_health = get_health();
-		next_game_state = incoming;
-		force_timeout = 32;
-		return true;
-	}
-	return false;
+	if (active_totems == 3) // (keyboard->WasPressed(input::Device::KeySpace))
+		return StateIncoming;
+	return StateNone;
 }
 
-// DAY PRELUDE
-int prelude_timeout = 48;
-
-bool day_prelude() {
-	draw_game_state_ui();
+void place_totems_exit() { last_wave_health = get_health(); }
 
-	apply_wave(0.003f);
-
-	auto day_title = stringify("DAY %1").arg(current_day);
-
-	g_plus->Text2D(500, 320, day_title, 128.f, Color::White, "Carton_Six.ttf");
+// DAY PRELUDE
+static const float prelude_duration = 0.8f;
 
-	active_totems = 0;
+void day_prelude_enter() { clear_totems(); }
 
-	if (--prelude_timeout == 0) {
-		prelude_timeout = 48;
-		next_game_state = place_totems;
-		return true;
-	}
+game_state_id day_prelude(float t) {
+	static ui_text day_title;
+	g_plus->Text2D(500, 320, day_title.get("DAY %1", current_day), 128.f, Color::White, ui_font);
 
-	return false;
+	return t < prelude_duration ? StateNone : StatePlaceTotems;
 }
 
 // TITLE SCREEN
 float title_a = 0.f;
 
 void draw_title(float offset_bg = 0.f) {
-	g_plus->Image2D(0, -offset_bg, 1280.f / 720.f, "title_bg.png");
+	draw_screen_image(ScreenTitleBg, 0, -offset_bg, float(screen_width) / screen_height);
 
 	float ox = math::Sin(title_a * -1.1f) * math::Cos(title_a * 2.f) * 10.f;
 	float oy = math::Sin(title_a * 1.5f) * math::Cos(title_a * -1.2f) * 10.f;
 	title_a += 0.05f;
 
-	g_plus->Image2D(140 + ox, 177 + oy - offset_bg, 1000.f / 1920.f, "title.png");
+	draw_screen_image(ScreenTitle, 140 + ox, 177 + oy - offset_bg, 1000.f / 1920.f);
 }
 
-float main_menu_out_t = 0;
+// the title scrolls away over two seconds, the water is only meshed again once it stops covering the screen
+static const float title_cover_duration = 1.f, title_reveal_duration = 1.f;
+
+float title_scroll_offset(float t) { return math::Pow(t / sim_step, 1.75f); }
 
-bool main_menu_out() {
-	apply_wave(0.005f);
+game_state_id main_menu_out(float t) {
+	draw_title(title_scroll_offset(t));
 
-	auto offset_bg = math::Pow(main_menu_out_t, 1.75f);
-	draw_title(offset_bg);
+	//	log(stringify("t: %1").arg(t));
 
-	main_menu_out_t += 1.f;
+	return t < title_cover_duration ? StateNone : StateMainMenuReveal;
+}
 
-	log(stringify("t: %1").arg(main_menu_out_t));
+game_state_id main_menu_reveal(float t) {
+	draw_title(title_scroll_offset(title_cover_duration + t));
+	return t < title_reveal_duration ? StateNone : StateDayPrelude;
+}
 
-	if (main_menu_out_t > 60.f)
-		fast_background_simulation = false;
+static const float press_space_blink = 0.2f;
 
-	if (main_menu_out_t > 120.f) {
-		next_game_state = day_prelude;
-		main_menu_out_t = 0;
-		return true;
+game_state_id main_menu_idle(float t) {
+	draw_title();
+
+	if (int(t / press_space_blink) & 1)
+		g_plus->Text2D(590, 100, "Press Space", 32.f, Color::White, ui_font);
+
+	if (keyboard->WasPressed(input::Device::KeySpace)) {
+		current_day = 1;
+		return StateMainMenuOut;
 	}
+	return StateNone;
+}
 
-	return false;
+void end_screen_exit() { simulation.send(SimResetHomes); }
+
+/* GAME STATE MACHINE */
+
+// Each state is a row of hooks and the frame stages it needs. The update hook receives the simulation time spent in
+// the state and returns the state to switch to, or StateNone to stay. Stages a state does not flag are skipped.
+enum game_stage : uint32_t {
+	StageWater = 0x01, // iso splat, smoothing, meshing and drawing
+	StageTotems = 0x02,
+	StageHud = 0x04,
+	StageFullSim = 0x08, // full fidelity particle solve, the background tier runs otherwise
+	StageFloodLoop = 0x10, // play the baked flood loop when there is one, the simulation runs otherwise
+};
+
+struct game_state_desc {
+	uint32_t stages;
+	float wave; // apply_wave strength every simulation step, 0 for none
+
+	void (*enter)();
+	game_state_id (*update)(float t);
+	void (*exit)();
+};
+
+static const uint32_t StageScene = StageWater | StageTotems | StageFullSim, StagePlay = StageScene | StageHud;
+
+// the title covers the screen while scrolling out, long enough for the solver to blend back to full fidelity
+const game_state_desc game_states[StateCount] = {
+	{StageFloodLoop, 0.005f, nullptr, main_menu_idle, nullptr}, // StateMainMenuIdle
+	{StageFullSim, 0.005f, nullptr, main_menu_out, nullptr}, // StateMainMenuOut
+	{StageScene, 0.005f, nullptr, main_menu_reveal, nullptr}, // StateMainMenuReveal
+	{StagePlay, 0.003f, day_prelude_enter, day_prelude, nullptr}, // StateDayPrelude
+	{StagePlay, 0.005f, nullptr, place_totems, place_totems_exit}, // StatePlaceTotems
+	{StageScene, 0.005f, nullptr, incoming, nullptr}, // StateIncoming
+	{StagePlay, 0.f, run_wave_enter, run_wave, run_wave_exit}, // StateRunWave
+	{StagePlay, 0.001f, night_cycle_enter, night_cycle, nullptr}, // StateNightCycle
+	{StageScene, 0.f, nullptr, game_over, end_screen_exit}, // StateGameOver
+	{StageScene, 0.f, nullptr, victory, end_screen_exit}, // StateVictory
+};
+
+game_state_id game_state = StateNone;
+uint32_t game_state_enter_step = 0; // simulation step the state was entered on
+
+void set_game_state(game_state_id id) {
+	if (game_state != StateNone && game_states[game_state].exit)
+		game_states[game_state].exit();
+
+	game_state = id;
+	game_state_enter_step = sim_view->step;
+
+	simulation.send(SimWave, game_states[id].wave);
+	simulation.send(SimFullFidelity, (game_states[id].stages & StageFullSim) ? 1.f : 0.f);
+	simulation.send(SimFloodLoop, (game_states[id].stages & StageFloodLoop) ? 1.f : 0.f);
+
+	if (game_states[id].enter)
+		game_states[id].enter();
 }
 
-int press_space_t = 0;
+uint32_t game_state_stages() { return game_states[game_state].stages; }
 
-bool main_menu_idle() {
-	fast_background_simulation = true;
+void update_game_state() {
+	auto &state = game_states[game_state];
 
-	apply_wave(0.005f);
+	if (state.stages & StageHud)
+		draw_game_state_ui();
 
-	draw_title();
+	auto next = state.update((sim_view->step - game_state_enter_step) * sim_step);
 
-	if ((press_space_t / 12) & 1)
-		g_plus->Text2D(590, 100, "Press Space", 32.f, Color::White, "Carton_Six.ttf");
-	++press_space_t;
+	if (next != StateNone)
+		set_game_state(next);
+}
 
-	if (keyboard->WasPressed(input::Device::KeySpace)) {
-		current_day = 1;
+// Bake step (-record-flood-loop, see work/convert.bat): run the solver under the main menu wave, record it and save
+// the loop to the data directory. Nothing is rendered, the simulation thread runs at its own pace.
+void record_flood_loop() {
+	set_game_state(StateMainMenuIdle);
+	simulation.send(SimFloodLoop, 0.f); // simulate, do not play a previous recording
+	simulation.send(SimFullFidelity, 1.f); // the background tier only moves every few steps, the loop would stutter
+
+	auto wait = [](std::function<bool(const sim_snapshot &)> done) {
+		while (!done(simulation.view()))
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	};
+
+	const auto start = simulation.view().step + flood_loop_warmup_steps;
+	wait([start](const sim_snapshot &s) { return s.step >= start; });
+
+	simulation.send(SimRecordFloodLoop, float(flood_loop_record_frames));
+	wait([](const sim_snapshot &s) { return s.stats.flood_record_left > 0; });
+	wait([](const sim_snapshot &s) { return s.stats.flood_record_left == 0; }); // saved once the last frame is in
+
+	sim_view = &simulation.view(); // the one acquired before recording has been recycled
+}
+
+/* PACK FILESYSTEM */
+
+// Read-only driver over an archive built by work/asset_bake pack. The archive is memory mapped, opening a path is a
+// binary search of the hash sorted index. Raw entries are served straight from the mapping, LZ4 entries are inflated
+// once when opened.
+struct pack_handle : io::Handle {
+	const uint8_t *data = nullptr;
+	size_t size = 0, cursor = 0;
+	std::vector<uint8_t> inflated;
+};
+
+struct pack_driver : io::Driver {
+	explicit pack_driver(const char *path) {
+		if (!file.map(path) || file.size() < sizeof(baked_pack::header)) {
+			unmap();
+			return;
+		}
+		base = file.data();
+
+		auto hdr = reinterpret_cast<const baked_pack::header *>(base);
+		if (hdr->magic != baked_pack::magic || hdr->version != baked_pack::version || uint64_t(hdr->string_offset) + hdr->string_size > file.size() ||
+			uint64_t(hdr->index_offset) + uint64_t(hdr->entry_count) * sizeof(baked_pack::entry) > file.size()) {
+			unmap();
+			return;
+		}
+
+		index = reinterpret_cast<const baked_pack::entry *>(base + hdr->index_offset);
+		index_end = index + hdr->entry_count;
+		strings = reinterpret_cast<const char *>(base + hdr->string_offset);
+		string_size = hdr->string_size;
+	}
+
+	~pack_driver() { unmap(); }
+
+	bool IsOpen() const { return base != nullptr; }
+
+	// straight into the mapping, null if missing or compressed
+	const uint8_t *map_entry(const std::string &path, size_t &size) const {
+		auto e = find(path);
+		if (!e || (e->flags & baked_pack::EntryLZ4) || e->offset + e->size > file.size())
+			return nullptr;
+		size = e->size;
+		return base + e->offset;
+	}
+
+	io::sHandle Open(const std::string &path, io::Mode mode) override {
+		if (mode != io::ModeRead)
+			return nullptr;
+
+		auto e = find(path);
+		if (!e || e->offset + ((e->flags & baked_pack::EntryLZ4) ? e->packed_size : e->size) > file.size())
+			return nullptr;
+
+		auto h = std::make_shared<pack_handle>();
+		if (e->flags & baked_pack::EntryLZ4) {
+			h->inflated.resize(e->size);
+			if (baked_pack::lz4_decompress(base + e->offset, e->packed_size, h->inflated.data(), e->size) != e->size)
+				return nullptr;
+			h->data = h->inflated.data();
+		}
+		else {
+			h->data = base + e->offset; // zero copy
+		}
+		h->size = e->size;
+		return h;
+	}
+
+	void Close(io::Handle &h) override {}
+
+	size_t Tell(io::Handle &h) override { return static_cast<pack_handle &>(h).cursor; }
+
+	size_t Seek(io::Handle &h, ptrdiff_t offset, io::SeekRef ref) override {
+		auto &p = static_cast<pack_handle &>(h);
+		ptrdiff_t cursor = offset;
+		if (ref == io::SeekCurrent)
+			cursor += p.cursor;
+		else if (ref == io::SeekEnd)
+			cursor += p.size;
+		p.cursor = size_t(math::Clamp<ptrdiff_t>(cursor, 0, p.size));
+		return p.cursor;
+	}
 
-		next_game_state = main_menu_out;
+	size_t Size(io::Handle &h) override { return static_cast<pack_handle &>(h).size; }
+
+	bool IsEOF(io::Handle &h) override {
+		auto &p = static_cast<pack_handle &>(h);
+		return p.cursor >= p.size;
+	}
+
+	size_t Read(io::Handle &h, void *out, size_t size) override {
+		auto &p = static_cast<pack_handle &>(h);
+		size = std::min(size, p.size - p.cursor);
+		memcpy(out, p.data + p.cursor, size);
+		p.cursor += size;
+		return size;
+	}
+
+	size_t Write(io::Handle &h, const void *in, size_t size) override { return 0; }
+
+	bool Delete(const std::string &path) override { return false; }
+
+private:
+	const baked_pack::entry *find(std::string path) const {
+		std::replace(path.begin(), path.end(), '\\', '/');
+
+		auto hash = baked_pack::path_hash(path.c_str());
+		auto e = std::lower_bound(index, index_end, hash, [](const baked_pack::entry &e, uint64_t hash) { return e.hash < hash; });
+
+		for (; e != index_end && e->hash == hash; ++e)
+			if (e->path < string_size && path == strings + e->path)
+				return e;
+		return nullptr;
+	}
+
+	void unmap() {
+		file.unmap();
+		base = nullptr;
+	}
+
+	mapped_file file;
+	const uint8_t *base = nullptr;
+
+	const baked_pack::entry *index = nullptr, *index_end = nullptr;
+	const char *strings = nullptr;
+	uint32_t string_size = 0;
+};
+
+std::shared_ptr<pack_driver> data_pack; // null when running from loose files or a zip
+
+// a raw entry of the mounted pack is served in place, any other file is loaded in storage through g_fs
+bool load_data_file(const char *path, ByteArray &storage, const uint8_t *&data, size_t &size) {
+	if (data_pack && (data = data_pack->map_entry(path, size)))
 		return true;
+
+	if (!g_fs->FileLoad(path, storage))
+		return false;
+
+	data = reinterpret_cast<const uint8_t *>(storage.data());
+	size = storage.size();
+	return true;
+}
+
+/* TERRAIN RESOURCES */
+
+// Duplicate geometries are collapsed offline (work/asset_bake dedup writes terrain.dedup.scn) so repeated houses and
+// trees share a single geometry and batch in the renderable system. Materials are referenced from inside the geometry
+// files and cannot be rewritten offline, their aliases are entered in the render system material cache before the
+// scene loads so a geometry referencing a duplicate gets the canonical material and the duplicate is never loaded.
+// Alias keys are the material paths exactly as stored in the geometry files, see asset_bake dedup.
+int terrain_material_aliases = 0;
+
+void register_material_alias(const char *alias, const char *canonical) {
+	auto render_system = g_plus->GetRenderSystem();
+	render_system->GetMaterialCache().Add(alias, render_system->LoadMaterial(canonical));
+	++terrain_material_aliases;
+}
+
+// manifest of an unbaked scene, a baked scene carries its aliases
+void load_terrain_material_aliases(const char *path) {
+	ByteArray manifest;
+	if (!g_fs->FileLoad(path, manifest))
+		return;
+
+	std::string text(manifest.begin(), manifest.end());
+
+	for (size_t i = 0; i < text.size();) {
+		auto eol = text.find('\n', i);
+		if (eol == std::string::npos)
+			eol = text.size();
+
+		auto tab = text.find('\t', i);
+		if (tab < eol)
+			register_material_alias(text.substr(i, tab - i).c_str(), text.substr(tab + 1, eol - tab - 1).c_str());
+
+		i = eol + 1;
 	}
-	return false;
+}
+
+void log_terrain_resources(core::Scene &scn) {
+	std::map<render::Geometry *, int> instances;
+	int object_count = 0;
+
+	const auto nodes = scn.GetNodes();
+	for (auto &node : nodes) {
+		auto object = node->GetComponent<core::Object>();
+		if (!object || !object->GetGeometry())
+			continue;
+
+		++object_count;
+		++instances[object->GetGeometry().get()];
+	}
+
+	log(stringify("terrain: %1 object(s), %2 unique geometry, %3 material alias(es)").arg(object_count).arg(instances.size()).arg(terrain_material_aliases));
+}
+
+/* BAKED SCENE */
+
+// Load a scene baked by work/asset_bake (see bake_formats.h), records are consumed in place with no text parsing.
+// The JSON terrain.scn stays the editable source, returns false if the baked file is missing, of another format
+// version or if any table, record index or string offset falls outside the file, nothing is added to the scene then.
+// Edits to terrain.scn are not detected, rerun work/convert.bat after changing it.
+bool load_baked_scene(const char *path, core::Scene &scn) {
+	ByteArray data;
+	if (!g_fs->FileLoad(path, data) || data.size() < sizeof(baked_scene::header))
+		return false;
+
+	auto base = data.data();
+	auto hdr = reinterpret_cast<const baked_scene::header *>(base);
+
+	if (hdr->magic != baked_scene::magic || hdr->version != baked_scene::version)
+		return false;
+
+	auto fits = [&data](uint32_t offset, uint32_t count, size_t record_size) { return uint64_t(offset) + uint64_t(count) * record_size <= data.size(); };
+
+	if (!fits(hdr->node_offset, hdr->node_count, sizeof(baked_scene::node)) || !fits(hdr->object_offset, hdr->object_count, sizeof(baked_scene::object)) ||
+		!fits(hdr->light_offset, hdr->light_count, sizeof(baked_scene::light)) || !fits(hdr->camera_offset, hdr->camera_count, sizeof(baked_scene::camera)) ||
+		!fits(hdr->material_alias_offset, hdr->material_alias_count, sizeof(baked_scene::material_alias)) || !fits(hdr->string_offset, hdr->string_size, 1) ||
+		!hdr->string_size || base[hdr->string_offset + hdr->string_size - 1] != 0)
+		return false;
+
+	auto nodes = reinterpret_cast<const baked_scene::node *>(base + hdr->node_offset);
+	auto objects = reinterpret_cast<const baked_scene::object *>(base + hdr->object_offset);
+	auto lights = reinterpret_cast<const baked_scene::light *>(base + hdr->light_offset);
+	auto cameras = reinterpret_cast<const baked_scene::camera *>(base + hdr->camera_offset);
+	auto strings = base + hdr->string_offset;
+
+	// the blob is NUL terminated, any offset inside it reads a valid string
+	auto is_string = [hdr](uint32_t offset) { return offset < hdr->string_size; };
+	auto is_record = [](int32_t index, uint32_t count) { return index == baked_scene::no_component || (index >= 0 && uint32_t(index) < count); };
+
+	for (uint i = 0; i < hdr->node_count; ++i) {
+		auto &n = nodes[i];
+		if (!is_string(n.name) || !is_record(n.object, hdr->object_count) || !is_record(n.light, hdr->light_count) || !is_record(n.camera, hdr->camera_count))
+			return false;
+	}
+	for (uint i = 0; i < hdr->object_count; ++i)
+		if (!is_string(objects[i].geometry))
+			return false;
+	auto aliases = reinterpret_cast<const baked_scene::material_alias *>(base + hdr->material_alias_offset);
+	for (uint i = 0; i < hdr->material_alias_count; ++i)
+		if (!is_string(aliases[i].alias) || !is_string(aliases[i].canonical))
+			return false;
+
+	auto to_vector3 = [](const float *v) { return Vector3(v[0], v[1], v[2]); };
+	auto to_color = [](const float *v) { return Color(v[0], v[1], v[2]); };
+
+	if (hdr->environment_fields) {
+		auto env = std::make_shared<core::Environment>();
+		if (hdr->environment_fields & baked_scene::EnvironmentAmbientColor)
+			env->SetAmbientColor(to_color(hdr->ambient_color));
+		if (hdr->environment_fields & baked_scene::EnvironmentFogColor)
+			env->SetFogColor(to_color(hdr->fog_color));
+		scn.AddComponent(env);
+	}
+
+	// before any geometry load, see TERRAIN RESOURCES
+	for (uint i = 0; i < hdr->material_alias_count; ++i)
+		register_material_alias(strings + aliases[i].alias, strings + aliases[i].canonical);
+
+	auto render_system = g_plus->GetRenderSystem();
+
+	for (uint i = 0; i < hdr->node_count; ++i) {
+		auto &n = nodes[i];
+
+		auto node = std::make_shared<core::Node>();
+		node->SetName(strings + n.name);
+
+		auto trs = std::make_shared<core::Transform>();
+		trs->SetPosition(to_vector3(n.position));
+		trs->SetRotation(to_vector3(n.rotation));
+		trs->SetScale(to_vector3(n.scale));
+		node->AddComponent(trs);
+
+		if (n.object != baked_scene::no_component) {
+			auto object = std::make_shared<core::Object>();
+			object->SetGeometry(render_system->LoadGeometry(strings + objects[n.object].geometry));
+			node->AddComponent(object);
+		}
+
+		if (n.light != baked_scene::no_component) {
+			auto &l = lights[n.light];
+
+			static const core::Light::Model models[] = {core::Light::Model_Point, core::Light::Model_Linear, core::Light::Model_Spot};
+
+			auto light = std::make_shared<core::Light>();
+			light->SetModel(models[l.model <= baked_scene::LightSpot ? l.model : baked_scene::LightPoint]);
+			if (l.fields & baked_scene::LightShadowMap)
+				light->SetShadow(core::Light::Shadow_Map);
+			if (l.fields & baked_scene::LightShadowRange)
+				light->SetShadowRange(l.shadow_range);
+			if (l.fields & baked_scene::LightDiffuseColor)
+				light->SetDiffuseColor(to_color(l.diffuse_color));
+			if (l.fields & baked_scene::LightSpecularColor)
+				light->SetSpecularColor(to_color(l.specular_color));
+			if (l.fields & baked_scene::LightDiffuseIntensity)
+				light->SetDiffuseIntensity(l.diffuse_intensity);
+			node->AddComponent(light);
+		}
+
+		if (n.camera != baked_scene::no_component) {
+			auto &c = cameras[n.camera];
+
+			auto camera = std::make_shared<core::Camera>();
+			camera->SetZoomFactor(c.zoom_factor);
+			camera->SetZNear(c.znear);
+			camera->SetZFar(c.zfar);
+			camera->SetOrthographic((c.fields & baked_scene::CameraOrthographic) != 0);
+			node->AddComponent(camera);
+		}
+
+		scn.AddNode(node);
+	}
+
+	log(stringify("baked scene '%1': %2 node(s)").arg(path).arg(hdr->node_count));
+	return true;
 }
 
 //
@@ -831,15 +3637,26 @@ void init_lighting() {
 
 //
 void main(int argc, const char **argv) {
+	scratch = &render_scratch;
+
 	core::Init(argv[0]);
 	core::LoadPlugins();
 
-	g_plus->RenderInit(1280, 720, 8);
+	g_plus->RenderInit(screen_width, screen_height, 8);
+
+	workers.start(std::max(int(std::thread::hardware_concurrency()) - 1, 0));
 #ifdef PACKED
 	g_fs->Mount(std::make_shared<io::CFile>(), "@sys/");
-	auto zip_h = g_fs->Open("@sys/data.zip");
-	__RASSERT_MSG__(zip_h, "WWTFBBQ: Missing data.zip archive");
-	g_fs->Mount(std::make_shared<io::Zip>(zip_h));
+	auto pack = std::make_shared<pack_driver>("data.pak");
+	if (pack->IsOpen()) {
+		g_fs->Mount(pack);
+		data_pack = pack;
+	}
+	else {
+		auto zip_h = g_fs->Open("@sys/data.zip");
+		__RASSERT_MSG__(zip_h, "WWTFBBQ: Missing data.pak or data.zip archive");
+		g_fs->Mount(std::make_shared<io::Zip>(zip_h));
+	}
 #else
 	g_plus->MountFilePath("c:/gs-users/ggj2017/data");
 #endif
@@ -868,18 +3685,24 @@ void main(int argc, const char **argv) {
 	}
 
 	//
-	core::SceneDeserializationContext ctx(g_plus->GetRenderSystem());
-	LoadResourceFromPath("terrain/terrain.scn", *scn, gs::DocumentFormatUnknown, &ctx);
+	if (!load_baked_scene("terrain/terrain.bscn", *scn)) {
+		load_terrain_material_aliases("terrain/dedup.txt"); // not baked
+		core::SceneDeserializationContext ctx(g_plus->GetRenderSystem());
+		if (!LoadResourceFromPath("terrain/terrain.dedup.scn", *scn, gs::DocumentFormatUnknown, &ctx))
+			LoadResourceFromPath("terrain/terrain.scn", *scn, gs::DocumentFormatUnknown, &ctx); // not baked
+	}
 
 	for (uint i = 0; i < 8; ++i)
 		g_plus->UpdateScene(*scn, gs::time(1.f / 60.f)); // commit load
 
-	//
-	scene_picking = new core::ScenePicking(g_plus->GetRenderSystem());
-	scene_picking->Prepare(scn, false, true);
+	log_terrain_resources(*scn);
 
 	//
-	g_fs->FileLoad("height.raw", heightmap);
+	if (!heightmap_tiles.open("height.tiles")) {
+		ByteArray heightmap;
+		g_fs->FileLoad("height.raw", heightmap); // not baked
+		heightmap_tiles.open_raw(heightmap, 1024);
+	}
 
 	//
 	//	g_plus->AddLight(scn, Matrix4::RotationMatrix(Vector3(0.6, -0.4, 0)), core::Light::Model_Linear, 300);
@@ -895,6 +3718,8 @@ void main(int argc, const char **argv) {
 
 	g_plus->SetBlend2D(render::BlendAlpha);
 
+	init_ui();
+
 	//
 	green_disk = g_plus->GetRenderSystem()->LoadGeometry("totem/disque_vert.geo");
 	red_disk = g_plus->GetRenderSystem()->LoadGeometry("totem/disque_rouge.geo");
@@ -904,10 +3729,14 @@ void main(int argc, const char **argv) {
 	//
 	create_particle_field();
 
+	prefetch_field_heightmap();
+	heightmap_tiles.flush();
+
 	init_water();
 	init_lighting();
 
 	spawn_homes(*scn);
+	bake_scene_sdf(*scn);
 
 	//
 	mouse = g_plus->GetMouse();
@@ -918,19 +3747,66 @@ void main(int argc, const char **argv) {
 	bool update_iso_surface = true;
 	bool display_iso_surface = true;
 
+	simulation.start();
+	sim_view = &simulation.view();
+
+	const bool record_only = argc > 1 && !strcmp(argv[1], "-record-flood-loop");
+	if (record_only)
+		record_flood_loop();
+
 #ifdef PACKED
-	game_state = &main_menu_idle;
+	set_game_state(StateMainMenuIdle);
 #else
-	game_state = &place_totems;
+	set_game_state(StatePlaceTotems);
+#endif
+
+	bool morton_order = particle_morton_order;
+	Vector3 sent_eye(1e9f, 1e9f, 1e9f);
+
+#ifdef _DEBUG
+	uint32_t frame_heap_allocations = 0;
 #endif
 
-	while (!g_plus->IsAppEnded()) {
+	while (!record_only && !g_plus->IsAppEnded()) {
+		sim_view = &simulation.view();
+
 		// -- DEBUG UI
 #ifndef PACKED
 		ImGui::Begin("Debug");
+#ifdef _DEBUG
+		ImGui::Text("Heap allocations last frame: %d", int(frame_heap_allocations));
+#endif
+		ImGui::Text("Frame scratch peak: %d KB", int(render_scratch.peak / 1024));
+		ImGui::Text("Particle substeps: %d", sim_view->stats.substeps);
+		ImGui::Text("Neighbor list builds: %d, pairs: %d", sim_view->stats.list_builds, sim_view->stats.pairs);
+		if (ImGui::Checkbox("Z-order particles", &morton_order))
+			simulation.send(SimMortonOrder, morton_order ? 1.f : 0.f);
+		ImGui::Text("Neighbor read cache lines: %d", sim_view->stats.cache_lines);
+		ImGui::Text("Awake chunks: %d/%d, particles: %d", sim_view->stats.awake_chunks, field_chunk_count, sim_view->stats.awake_particles);
+		ImGui::Text("Height tiles resident: %d/%d, misses: %d", heightmap_tiles.resident_count(), height_tile_slots, heightmap_tiles.miss_count());
+		if (sim_view->stats.flood_record_left > 0)
+			ImGui::Text("Recording flood loop: %d frames left", sim_view->stats.flood_record_left);
+		else if (ImGui::Button("Record flood loop"))
+			simulation.send(SimRecordFloodLoop, float(flood_loop_record_frames));
+		{
+			auto impact = get_wave_impact();
+			ImGui::Text("Wave impact: %d hits, %.1f damage, peak velocity %.3f", int(impact.hits), impact.damage, impact.peak_velocity);
+
+			for (uint i = 0; i < sim_view->impacts.size(); ++i) {
+				auto &home = get_home_impact(i);
+				ImGui::Text("  Home %d: %d hits, %.1f damage, peak velocity %.3f", int(i), int(home.hits), home.damage, home.peak_velocity);
+			}
+		}
 		ImGui::Checkbox("Visualize fluid particles", &visualize_particles);
+		ImGui::Combo("Particle color", &debug_particle_color_mode, debug_particle_color_names, 4);
 		ImGui::Checkbox("Update iso surface", &update_iso_surface);
 		ImGui::Checkbox("Display iso surface", &display_iso_surface);
+		ImGui::SliderFloat("Water LOD distance", &water_lod_distance, 0.f, 1000.f);
+		ImGui::Checkbox("Cull water blocks", &water_culling);
+		ImGui::Text("Water blocks culled: %d frustum, %d occlusion", water_frustum_culled, water_occlusion_culled);
+		ImGui::SliderInt("Iso smoothing radius", &iso_smooth_radius, 0, 3);
+		ImGui::SliderInt("Iso interior neighbors", &iso_interior_neighbors, 0, 256);
+		ImGui::Text("Iso splats: %d surface, %d interior", iso_surface_splats, iso_interior_fills);
 		ImGui::End();
 #endif
 
@@ -940,33 +3816,53 @@ void main(int argc, const char **argv) {
 		fps.UpdateAndApplyToNode(cam, dt);
 #endif
 
-		update_particle_field();
+		auto stages = game_state_stages();
+		auto camera = get_camera_view(*cam);
+
+		auto eye = camera.world.GetTranslation();
+		if (Vector3::Dist2(eye, sent_eye) > 0.f) {
+			simulation.send(SimViewEye, 0.f, eye); // only when the camera moved, the queue is bounded
+			sent_eye = eye;
+		}
+
 		if (visualize_particles)
-			debug_particle_field(*gfx);
+			debug_particle_field(*sim_view);
 
-		if (!fast_background_simulation) {
+		if (stages & StageWater) {
 			if (update_iso_surface) {
-				particles_to_iso_field();
-				water_to_render_geometry();
+				particles_to_iso_field(*sim_view);
+				smooth_iso_field(iso_smooth_radius);
+				water_to_render_geometry(make_water_camera(camera));
 			}
 
 			if (display_iso_surface)
-				renderable_system->DrawGeometry(water_geo, Matrix4::TranslationMatrix(iso_min));
+				draw_water(*renderable_system);
 		}
 
 		//-- TOTEMS
-		for (uint i = 0; i < active_totems; ++i)
-			renderable_system->DrawGeometry(totem, Matrix4::TransformationMatrix(totems[i].pos, Vector3::Zero, Vector3(3, 3, 3)));
+		if (stages & StageTotems)
+			for (uint i = 0; i < active_totems; ++i)
+				renderable_system->DrawGeometry(totem, Matrix4::TransformationMatrix(totems[i].pos, Vector3::Zero, Vector3(3, 3, 3)));
 
 		//-- UPDATE SCENE
 		g_plus->UpdateScene(*scn, dt);
 
+		if (visualize_particles)
+			draw_debug_particle_field(*g_plus->GetRenderSystem(), camera);
+
 		//-- GAME STATE
-		if (game_state())
-			game_state = next_game_state;
+		update_game_state();
 
 		g_plus->Flip();
+
+		scratch->reset();
+#ifdef _DEBUG
+		frame_heap_allocations = heap_allocation_count.exchange(0);
+#endif
 	}
 
+	simulation.stop();
+	heightmap_tiles.close();
+	workers.stop();
 	core::Uninit();
 }
@@ -0,0 +1,801 @@
+// INSANELY WAVY TSUNAMI PANIC - offline asset bake
+// ------------------------------------------------
+// Standalone, no framework dependency: g++ -std=c++11 -O2 asset_bake.cpp -o asset_bake
+//
+// asset_bake dedup <data dir>
+//	hash every geometry referenced by terrain/terrain.scn and every material referenced by those geometries,
+//	write terrain/terrain.dedup.scn with duplicate geometries collapsed to one canonical file and
+//	terrain/dedup.txt listing the material aliases the scene bake registers.
+//
+// asset_bake scene <data dir> <in.scn> <out.bscn>
+//	convert a JSON scene document to the flat baked scene format of bake_formats.h, the material aliases of the
+//	dedup.txt next to the scene are baked along so the runtime resolves them before loading any geometry.
+//
+// asset_bake pack <data dir> <out.pak>
+//	pack the files of the data directory in an indexed archive, LZ4 compressed when it pays off. Bake inputs are
+//	left out, already compressed formats are stored raw.
+//
+// asset_bake height <data dir> <in.raw> <out.tiles>
+//	cut a square float heightmap in quantized tiles the runtime streams on demand, LZ4 compressed when it pays off.
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../bake_formats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+/* COMMON */
+
+static bool file_load(const std::string &path, std::vector<char> &data) {
+	auto f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	data.resize(ftell(f));
+	fseek(f, 0, SEEK_SET);
+	auto read = fread(data.data(), 1, data.size(), f);
+	fclose(f);
+	return read == data.size();
+}
+
+static bool file_save(const std::string &path, const void *data, size_t size) {
+	auto f = fopen(path.c_str(), "wb");
+	if (!f)
+		return false;
+
+	auto written = fwrite(data, 1, size, f);
+	fclose(f);
+	return written == size;
+}
+
+static uint64_t fnv1a_64(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ull) {
+	auto p = reinterpret_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < size; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static int strcasecmp_ascii(const char *a, const char *b) {
+	for (; *a && tolower(uint8_t(*a)) == tolower(uint8_t(*b)); ++a, ++b)
+		;
+	return tolower(uint8_t(*a)) - tolower(uint8_t(*b));
+}
+
+/* DEDUP */
+
+// content-addressed registry: identical bytes resolve to the first path registered (paths are fed sorted)
+struct content_registry {
+	struct entry {
+		std::string path;
+		std::vector<char> data;
+	};
+
+	std::map<uint64_t, std::vector<entry>> buckets;
+	std::map<std::string, std::string> canonical; // path -> canonical path
+
+	bool add(const std::string &root, const std::string &path) {
+		if (canonical.count(path))
+			return true;
+
+		std::vector<char> data;
+		if (!file_load(root + path, data)) {
+			fprintf(stderr, "cannot load '%s'\n", path.c_str());
+			return false;
+		}
+
+		auto &bucket = buckets[fnv1a_64(data.data(), data.size())];
+		for (auto &e : bucket)
+			if (e.data == data) { // guard against hash collisions
+				canonical[path] = e.path;
+				return true;
+			}
+
+		bucket.push_back({path, std::move(data)});
+		canonical[path] = path;
+		return true;
+	}
+
+	size_t unique_count() const {
+		size_t count = 0;
+		for (auto &b : buckets)
+			count += b.second.size();
+		return count;
+	}
+};
+
+// collect the value of every '"Geometry": "<path>"' entry of a scene document
+static std::vector<std::string> scene_geometry_refs(const std::string &scn) {
+	static const char *key = "\"Geometry\": \"";
+
+	std::vector<std::string> refs;
+	for (size_t i = scn.find(key); i != std::string::npos; i = scn.find(key, i)) {
+		i += strlen(key);
+		auto e = scn.find('"', i);
+		refs.push_back(scn.substr(i, e - i));
+	}
+	return refs;
+}
+
+// material names live in the geometry string table as NUL-terminated '*.mat' strings
+static std::vector<std::string> geometry_material_refs(const std::vector<char> &geo) {
+	std::vector<std::string> refs;
+
+	size_t s = 0;
+	for (size_t i = 0; i < geo.size(); ++i)
+		if (geo[i] == 0) {
+			if (i - s > 4 && !memcmp(&geo[i - 4], ".mat", 4)) {
+				size_t b = i - 4;
+				while (b > s && uint8_t(geo[b - 1]) >= 0x20)
+					--b; // walk back over printable (and UTF-8) bytes
+				refs.push_back(std::string(&geo[b], i - b));
+			}
+			s = i + 1;
+		}
+
+	return refs;
+}
+
+static int dedup(const std::string &root) {
+	std::vector<char> scn_data;
+	if (!file_load(root + "terrain/terrain.scn", scn_data)) {
+		fprintf(stderr, "cannot load terrain/terrain.scn\n");
+		return 1;
+	}
+	std::string scn(scn_data.begin(), scn_data.end());
+
+	// geometries
+	auto geo_refs = scene_geometry_refs(scn);
+	std::sort(geo_refs.begin(), geo_refs.end());
+	geo_refs.erase(std::unique(geo_refs.begin(), geo_refs.end()), geo_refs.end());
+
+	content_registry geos;
+	for (auto &path : geo_refs)
+		if (!geos.add(root, path))
+			return 1;
+
+	// materials of the surviving geometries
+	std::vector<std::string> mat_refs;
+	for (auto &b : geos.buckets)
+		for (auto &e : b.second) {
+			auto refs = geometry_material_refs(e.data);
+			mat_refs.insert(mat_refs.end(), refs.begin(), refs.end());
+		}
+
+	std::sort(mat_refs.begin(), mat_refs.end());
+	mat_refs.erase(std::unique(mat_refs.begin(), mat_refs.end()), mat_refs.end());
+
+	content_registry mats;
+	for (auto &path : mat_refs)
+		if (!mats.add(root, path))
+			return 1;
+
+	// rewrite scene geometry references
+	for (auto &c : geos.canonical) {
+		if (c.first == c.second)
+			continue;
+
+		auto from = "\"" + c.first + "\"", to = "\"" + c.second + "\"";
+		for (size_t i = scn.find(from); i != std::string::npos; i = scn.find(from, i + to.size()))
+			scn.replace(i, from.size(), to);
+	}
+
+	if (!file_save(root + "terrain/terrain.dedup.scn", scn.data(), scn.size()))
+		return 1;
+
+	// material alias manifest, one 'alias canonical' pair per line (paths may contain spaces, tab separated)
+	std::string manifest;
+	for (auto &c : mats.canonical)
+		if (c.first != c.second)
+			manifest += c.first + "\t" + c.second + "\n";
+
+	if (!file_save(root + "terrain/dedup.txt", manifest.data(), manifest.size()))
+		return 1;
+
+	printf("geometry: %d referenced, %d unique\n", int(geos.canonical.size()), int(geos.unique_count()));
+	printf("material: %d referenced, %d unique\n", int(mats.canonical.size()), int(mats.unique_count()));
+	return 0;
+}
+
+/* SCENE */
+
+// minimal JSON reader, scene documents repeat keys ("Node") so members are kept as an ordered list
+struct json_value {
+	enum type_t { Null, Bool, Number, String, Object } type = Null;
+
+	double number = 0;
+	std::string string;
+	std::vector<std::pair<std::string, json_value>> members;
+
+	const json_value *get(const char *key) const {
+		for (auto &m : members)
+			if (m.first == key)
+				return &m.second;
+		return nullptr;
+	}
+
+	float get_number(const char *key, float def) const {
+		auto v = get(key);
+		return v && v->type == Number ? float(v->number) : def;
+	}
+};
+
+struct json_reader {
+	const char *p, *end;
+	bool error = false;
+
+	void skip_ws() {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+			++p;
+	}
+
+	bool expect(char c) {
+		skip_ws();
+		if (p < end && *p == c) {
+			++p;
+			return true;
+		}
+		error = true;
+		return false;
+	}
+
+	std::string read_string() {
+		std::string s;
+		if (!expect('"'))
+			return s;
+		while (p < end && *p != '"') {
+			if (*p == '\\' && p + 1 < end)
+				++p; // scene documents only escape quotes and backslashes
+			s += *p++;
+		}
+		expect('"');
+		return s;
+	}
+
+	json_value read_value() {
+		json_value v;
+		skip_ws();
+		if (p >= end) {
+			error = true;
+			return v;
+		}
+
+		if (*p == '{') {
+			++p;
+			v.type = json_value::Object;
+			skip_ws();
+			if (p < end && *p == '}') {
+				++p;
+				return v;
+			}
+			do {
+				auto key = read_string();
+				if (!expect(':'))
+					break;
+				v.members.emplace_back(key, read_value());
+				skip_ws();
+			} while (!error && p < end && *p == ',' && ++p);
+			expect('}');
+		} else if (*p == '"') {
+			v.type = json_value::String;
+			v.string = read_string();
+		} else if (!strncmp(p, "true", 4) || !strncmp(p, "false", 5)) {
+			v.type = json_value::Bool;
+			v.number = *p == 't' ? 1 : 0;
+			p += *p == 't' ? 4 : 5;
+		} else if (!strncmp(p, "null", 4)) {
+			p += 4;
+		} else {
+			char *e;
+			v.type = json_value::Number;
+			v.number = strtod(p, &e);
+			if (e == p)
+				error = true;
+			p = e;
+		}
+		return v;
+	}
+};
+
+static void get_vector(const json_value *v, const char *a, const char *b, const char *c, float *out) {
+	if (!v)
+		return;
+	out[0] = v->get_number(a, out[0]);
+	out[1] = v->get_number(b, out[1]);
+	out[2] = v->get_number(c, out[2]);
+}
+
+struct string_blob {
+	std::string data;
+	std::map<std::string, uint32_t> offsets;
+
+	uint32_t add(const std::string &s) {
+		auto i = offsets.find(s);
+		if (i != offsets.end())
+			return i->second;
+
+		auto offset = uint32_t(data.size());
+		data.append(s.c_str(), s.size() + 1);
+		offsets[s] = offset;
+		return offset;
+	}
+};
+
+template <typename T> static void append(std::vector<char> &out, const std::vector<T> &records, uint32_t &count, uint32_t &offset) {
+	count = uint32_t(records.size());
+	offset = uint32_t(out.size());
+	out.insert(out.end(), reinterpret_cast<const char *>(records.data()), reinterpret_cast<const char *>(records.data() + records.size()));
+}
+
+static int bake_scene(const std::string &root, const std::string &in_path, const std::string &out_path) {
+	std::vector<char> text;
+	if (!file_load(root + in_path, text)) {
+		fprintf(stderr, "cannot load '%s'\n", in_path.c_str());
+		return 1;
+	}
+
+	json_reader reader;
+	reader.p = text.data();
+	reader.end = text.data() + text.size();
+	auto doc = reader.read_value();
+	auto scene = doc.get("Scene");
+
+	if (reader.error || !scene) {
+		fprintf(stderr, "'%s' is not a scene document\n", in_path.c_str());
+		return 1;
+	}
+
+	baked_scene::header hdr = {};
+	hdr.magic = baked_scene::magic;
+	hdr.version = baked_scene::version;
+
+	if (auto components = scene->get("Components"))
+		if (auto env = components->get("gs::core::Environment")) {
+			if (auto c = env->get("AmbientColor")) {
+				get_vector(c, "r", "g", "b", hdr.ambient_color);
+				hdr.environment_fields |= baked_scene::EnvironmentAmbientColor;
+			}
+			if (auto c = env->get("FogColor")) {
+				get_vector(c, "r", "g", "b", hdr.fog_color);
+				hdr.environment_fields |= baked_scene::EnvironmentFogColor;
+			}
+		}
+
+	std::vector<baked_scene::node> nodes;
+	std::vector<baked_scene::object> objects;
+	std::vector<baked_scene::light> lights;
+	std::vector<baked_scene::camera> cameras;
+	string_blob strings;
+
+	if (auto scene_nodes = scene->get("Nodes"))
+		for (auto &m : scene_nodes->members) {
+			if (m.first != "Node")
+				continue;
+
+			auto &n = m.second;
+
+			baked_scene::node node = {uint32_t(n.get_number("Uid", 0)), 0, {0, 0, 0}, {0, 0, 0}, {1, 1, 1}, baked_scene::no_component, baked_scene::no_component, baked_scene::no_component};
+
+			if (auto name = n.get("Name"))
+				node.name = strings.add(name->string);
+			else
+				node.name = strings.add("");
+
+			auto components = n.get("Components");
+			if (!components)
+				continue;
+
+			if (auto trs = components->get("gs::core::Transform")) {
+				get_vector(trs->get("Position"), "x", "y", "z", node.position);
+				get_vector(trs->get("Rotation"), "x", "y", "z", node.rotation);
+				get_vector(trs->get("Scale"), "x", "y", "z", node.scale);
+			}
+
+			if (auto obj = components->get("gs::core::Object")) {
+				node.object = int32_t(objects.size());
+				auto geo = obj->get("Geometry");
+				objects.push_back({strings.add(geo ? geo->string : "")});
+			}
+
+			if (auto l = components->get("gs::core::Light")) {
+				baked_scene::light light = {};
+
+				// only written when it differs from the default point model
+				if (auto model = l->get("Model")) {
+					if (model->string == "Linear")
+						light.model = baked_scene::LightLinear;
+					else if (model->string == "Spot")
+						light.model = baked_scene::LightSpot;
+					else if (model->string != "Point")
+						fprintf(stderr, "node %d: unknown light model '%s', baked as point\n", int(node.uid), model->string.c_str());
+				}
+				if (auto shadow = l->get("Shadow"))
+					if (shadow->string == "ShadowMap")
+						light.fields |= baked_scene::LightShadowMap;
+				if (l->get("ShadowRange")) {
+					light.shadow_range = l->get_number("ShadowRange", 0);
+					light.fields |= baked_scene::LightShadowRange;
+				}
+				if (auto c = l->get("DiffuseColor")) {
+					get_vector(c, "r", "g", "b", light.diffuse_color);
+					light.fields |= baked_scene::LightDiffuseColor;
+				}
+				if (auto c = l->get("SpecularColor")) {
+					get_vector(c, "r", "g", "b", light.specular_color);
+					light.fields |= baked_scene::LightSpecularColor;
+				}
+				if (l->get("DiffuseIntensity")) {
+					light.diffuse_intensity = l->get_number("DiffuseIntensity", 1);
+					light.fields |= baked_scene::LightDiffuseIntensity;
+				}
+
+				node.light = int32_t(lights.size());
+				lights.push_back(light);
+			}
+
+			if (auto c = components->get("gs::core::Camera")) {
+				baked_scene::camera camera = {};
+				camera.zoom_factor = c->get_number("ZoomFactor", 1);
+				camera.znear = c->get_number("ZNear", 0.1f);
+				camera.zfar = c->get_number("ZFar", 1000.f);
+				if (auto ortho = c->get("IsOrthographic"))
+					if (ortho->number)
+						camera.fields |= baked_scene::CameraOrthographic;
+
+				node.camera = int32_t(cameras.size());
+				cameras.push_back(camera);
+			}
+
+			nodes.push_back(node);
+		}
+
+	// material aliases written by the dedup step, optional
+	std::vector<baked_scene::material_alias> aliases;
+
+	std::vector<char> manifest;
+	if (file_load(root + in_path.substr(0, in_path.find_last_of('/') + 1) + "dedup.txt", manifest)) {
+		std::string text(manifest.begin(), manifest.end());
+
+		for (size_t i = 0; i < text.size();) {
+			auto eol = text.find('\n', i);
+			if (eol == std::string::npos)
+				eol = text.size();
+
+			auto tab = text.find('\t', i);
+			if (tab < eol)
+				aliases.push_back({strings.add(text.substr(i, tab - i)), strings.add(text.substr(tab + 1, eol - tab - 1))});
+
+			i = eol + 1;
+		}
+	}
+
+	std::vector<char> out(sizeof(hdr));
+	append(out, nodes, hdr.node_count, hdr.node_offset);
+	append(out, objects, hdr.object_count, hdr.object_offset);
+	append(out, lights, hdr.light_count, hdr.light_offset);
+	append(out, cameras, hdr.camera_count, hdr.camera_offset);
+	append(out, aliases, hdr.material_alias_count, hdr.material_alias_offset);
+
+	hdr.string_size = uint32_t(strings.data.size());
+	hdr.string_offset = uint32_t(out.size());
+	out.insert(out.end(), strings.data.begin(), strings.data.end());
+
+	memcpy(out.data(), &hdr, sizeof(hdr));
+
+	if (!file_save(root + out_path, out.data(), out.size()))
+		return 1;
+
+	printf("scene: %d node(s), %d object(s), %d light(s), %d camera(s), %d material alias(es), %d bytes\n", int(nodes.size()), int(objects.size()), int(lights.size()), int(cameras.size()),
+		int(aliases.size()), int(out.size()));
+	return 0;
+}
+
+/* PACK */
+
+// greedy LZ4 block compressor, single hash probe per position
+static std::vector<uint8_t> lz4_compress(const uint8_t *src, size_t size) {
+	static const size_t min_match = 4, last_literals = 5, match_limit = 12, hash_bits = 16;
+
+	std::vector<uint8_t> out;
+	out.reserve(size + size / 255 + 16);
+
+	auto write_length = [&](size_t len) {
+		for (; len >= 255; len -= 255)
+			out.push_back(255);
+		out.push_back(uint8_t(len));
+	};
+
+	auto emit = [&](const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len) {
+		auto token = uint8_t((literal_len < 15 ? literal_len : 15) << 4);
+		if (match_len)
+			token |= uint8_t(match_len - min_match < 15 ? match_len - min_match : 15);
+		out.push_back(token);
+
+		if (literal_len >= 15)
+			write_length(literal_len - 15);
+		out.insert(out.end(), literals, literals + literal_len);
+
+		if (match_len) {
+			out.push_back(uint8_t(offset));
+			out.push_back(uint8_t(offset >> 8));
+			if (match_len - min_match >= 15)
+				write_length(match_len - min_match - 15);
+		}
+	};
+
+	auto read32 = [&](size_t i) {
+		uint32_t v;
+		memcpy(&v, src + i, 4);
+		return v;
+	};
+
+	std::vector<uint32_t> table(size_t(1) << hash_bits, 0);
+
+	size_t anchor = 0, i = 0;
+	if (size > match_limit)
+		while (i < size - match_limit) {
+			auto h = (read32(i) * 2654435761u) >> (32 - hash_bits);
+			size_t candidate = table[h];
+			table[h] = uint32_t(i);
+
+			if (candidate >= i || i - candidate > 65535 || read32(candidate) != read32(i)) {
+				++i;
+				continue;
+			}
+
+			size_t len = min_match;
+			while (i + len < size - last_literals && src[candidate + len] == src[i + len])
+				++len;
+
+			emit(src + anchor, i - anchor, i - candidate, len);
+			i += len;
+			anchor = i;
+		}
+
+	emit(src + anchor, size - anchor, 0, 0);
+	return out;
+}
+
+static void list_files(const std::string &root, const std::string &dir, std::vector<std::string> &files) {
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	auto h = FindFirstFileA((root + dir + "*").c_str(), &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		std::string name = fd.cFileName;
+		if (name == "." || name == "..")
+			continue;
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			list_files(root, dir + name + "/", files);
+		else
+			files.push_back(dir + name);
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	auto d = opendir((root + dir).c_str());
+	if (!d)
+		return;
+	while (auto e = readdir(d)) {
+		std::string name = e->d_name;
+		if (name == "." || name == "..")
+			continue;
+
+		struct stat st;
+		if (stat((root + dir + name).c_str(), &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			list_files(root, dir + name + "/", files);
+		else
+			files.push_back(dir + name);
+	}
+	closedir(d);
+#endif
+}
+
+// bake inputs, the game only reads their baked outputs
+static const char *pack_excluded[] = {"terrain/terrain.scn", "terrain/terrain.dedup.scn", "terrain/dedup.txt", "height.raw"};
+
+// already compressed formats, LZ4 gains little on them and raw entries are served zero copy
+static const char *pack_raw_extensions[] = {".png", ".jpg", ".jpeg", ".ogg", ".tiles", ".loop"};
+
+static bool has_extension(const std::string &path, const char *ext) {
+	auto n = strlen(ext);
+	return path.size() > n && strcasecmp_ascii(path.c_str() + path.size() - n, ext) == 0;
+}
+
+static int pack(const std::string &root, const std::string &out_path) {
+	std::vector<std::string> files;
+	list_files(root, "", files);
+	std::sort(files.begin(), files.end());
+
+	std::vector<char> out(sizeof(baked_pack::header));
+	std::vector<baked_pack::entry> index;
+	string_blob strings;
+
+	size_t raw_size = 0;
+	int compressed_count = 0;
+
+	for (auto &path : files) {
+		if (root + path == out_path || std::find(std::begin(pack_excluded), std::end(pack_excluded), path) != std::end(pack_excluded))
+			continue;
+
+		std::vector<char> data;
+		if (!file_load(root + path, data)) {
+			fprintf(stderr, "cannot load '%s'\n", path.c_str());
+			return 1;
+		}
+
+		baked_pack::entry e = {baked_pack::path_hash(path.c_str()), 0, uint32_t(data.size()), uint32_t(data.size()), 0, strings.add(path)};
+
+		// .tiles are streamed piecewise and .loop played in place, both must stay raw
+		bool raw = false;
+		for (auto ext : pack_raw_extensions)
+			raw |= has_extension(path, ext);
+
+		auto lz4 = raw ? std::vector<uint8_t>() : lz4_compress(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+		if (!raw && lz4.size() < data.size() - data.size() / 4) { // not worth an inflate on open otherwise
+			std::vector<uint8_t> check(data.size());
+			if (baked_pack::lz4_decompress(lz4.data(), lz4.size(), check.data(), check.size()) != data.size() || memcmp(check.data(), data.data(), data.size())) {
+				fprintf(stderr, "LZ4 round trip failed on '%s'\n", path.c_str());
+				return 1;
+			}
+
+			data.assign(lz4.begin(), lz4.end());
+			e.packed_size = uint32_t(data.size());
+			e.flags |= baked_pack::EntryLZ4;
+			++compressed_count;
+		}
+
+		out.resize((out.size() + baked_pack::page_size - 1) & ~size_t(baked_pack::page_size - 1));
+		e.offset = out.size();
+		out.insert(out.end(), data.begin(), data.end());
+
+		raw_size += e.size;
+		index.push_back(e);
+	}
+
+	std::sort(index.begin(), index.end(), [](const baked_pack::entry &a, const baked_pack::entry &b) { return a.hash < b.hash; });
+
+	baked_pack::header hdr = {baked_pack::magic, baked_pack::version, 0, 0, 0, 0};
+
+	out.resize((out.size() + 7) & ~size_t(7));
+	append(out, index, hdr.entry_count, hdr.index_offset);
+
+	hdr.string_size = uint32_t(strings.data.size());
+	hdr.string_offset = uint32_t(out.size());
+	out.insert(out.end(), strings.data.begin(), strings.data.end());
+
+	memcpy(out.data(), &hdr, sizeof(hdr));
+
+	if (!file_save(out_path, out.data(), out.size()))
+		return 1;
+
+	printf("pack: %d file(s), %d compressed, %d bytes raw, %d bytes packed\n", int(index.size()), compressed_count, int(raw_size), int(out.size()));
+	return 0;
+}
+
+/* HEIGHT */
+
+static const uint32_t height_tile_size = 128, height_overview_step = 16;
+
+static int bake_height(const std::string &root, const std::string &in_path, const std::string &out_path) {
+	std::vector<char> raw;
+	if (!file_load(root + in_path, raw)) {
+		fprintf(stderr, "cannot load '%s'\n", in_path.c_str());
+		return 1;
+	}
+
+	auto size = uint32_t(sqrt(double(raw.size() / sizeof(float))));
+	if (!size || size % height_tile_size || size_t(size) * size * sizeof(float) != raw.size()) {
+		fprintf(stderr, "'%s' is not a square heightmap of %d sample tiles\n", in_path.c_str(), int(height_tile_size));
+		return 1;
+	}
+
+	auto in = reinterpret_cast<const float *>(raw.data());
+	auto minmax = std::minmax_element(in, in + size_t(size) * size);
+
+	baked_height::header hdr = {baked_height::magic, baked_height::version, size, size, height_tile_size, size / height_tile_size,
+		size / height_tile_size, height_overview_step, 0, 0, *minmax.first, *minmax.second};
+
+	auto sample = [&](uint32_t x, uint32_t z) { return baked_height::quantize(in[x + z * size], hdr.height_min, hdr.height_max); };
+
+	std::vector<baked_height::tile> tiles(hdr.tiles_x * hdr.tiles_z);
+
+	// overview, highest sample of each block
+	const uint32_t overview_res = size / height_overview_step;
+	std::vector<uint16_t> overview(overview_res * overview_res, 0);
+	for (uint32_t z = 0; z < size; ++z)
+		for (uint32_t x = 0; x < size; ++x) {
+			auto &o = overview[x / height_overview_step + (z / height_overview_step) * overview_res];
+			o = std::max(o, sample(x, z));
+		}
+
+	std::vector<char> out(sizeof(hdr) + tiles.size() * sizeof(baked_height::tile));
+	hdr.tile_offset = sizeof(hdr);
+	hdr.overview_offset = uint32_t(out.size());
+	out.insert(out.end(), reinterpret_cast<const char *>(overview.data()), reinterpret_cast<const char *>(overview.data() + overview.size()));
+
+	int compressed_count = 0;
+
+	std::vector<uint16_t> samples(height_tile_size * height_tile_size);
+	for (uint32_t t_z = 0; t_z < hdr.tiles_z; ++t_z)
+		for (uint32_t t_x = 0; t_x < hdr.tiles_x; ++t_x) {
+			for (uint32_t z = 0; z < height_tile_size; ++z)
+				for (uint32_t x = 0; x < height_tile_size; ++x)
+					samples[x + z * height_tile_size] = sample(t_x * height_tile_size + x, t_z * height_tile_size + z);
+
+			auto data = reinterpret_cast<const uint8_t *>(samples.data());
+			auto data_size = samples.size() * sizeof(uint16_t);
+
+			auto &t = tiles[t_x + t_z * hdr.tiles_x];
+			t = {0, uint32_t(data_size), uint32_t(data_size), 0};
+
+			auto lz4 = lz4_compress(data, data_size);
+			if (lz4.size() < data_size - data_size / 8) {
+				std::vector<uint16_t> check(samples.size());
+				if (baked_pack::lz4_decompress(lz4.data(), lz4.size(), reinterpret_cast<uint8_t *>(check.data()), data_size) != data_size || check != samples) {
+					fprintf(stderr, "LZ4 round trip failed on tile %d,%d\n", int(t_x), int(t_z));
+					return 1;
+				}
+
+				t.packed_size = uint32_t(lz4.size());
+				t.flags |= baked_height::TileLZ4;
+				data = lz4.data();
+				++compressed_count;
+			}
+
+			out.resize((out.size() + 3) & ~size_t(3));
+			t.offset = uint32_t(out.size());
+			out.insert(out.end(), reinterpret_cast<const char *>(data), reinterpret_cast<const char *>(data) + t.packed_size);
+		}
+
+	memcpy(out.data(), &hdr, sizeof(hdr));
+	memcpy(out.data() + hdr.tile_offset, tiles.data(), tiles.size() * sizeof(baked_height::tile));
+
+	if (!file_save(root + out_path, out.data(), out.size()))
+		return 1;
+
+	printf("height: %dx%d, %d tile(s), %d compressed, %d bytes\n", int(size), int(size), int(tiles.size()), compressed_count, int(out.size()));
+	return 0;
+}
+
+//
+int main(int argc, const char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: asset_bake dedup <data dir>\n       asset_bake scene <data dir> <in.scn> <out.bscn>\n       asset_bake pack <data dir> <out.pak>\n       asset_bake height <data dir> <in.raw> <out.tiles>\n");
+		return 1;
+	}
+
+	std::string cmd = argv[1], root = argv[2];
+	if (!root.empty() && root.back() != '/' && root.back() != '\\')
+		root += '/';
+
+	if (cmd == "dedup")
+		return dedup(root);
+	if (cmd == "scene" && argc == 5)
+		return bake_scene(root, argv[3], argv[4]);
+	if (cmd == "pack" && argc == 4)
+		return pack(root, argv[3]);
+	if (cmd == "height" && argc == 5)
+		return bake_height(root, argv[3], argv[4]);
+
+	fprintf(stderr, "unknown command '%s'\n", cmd.c_str());
+	return 1;
+}
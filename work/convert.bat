@@ -1 +1,7 @@
-fbx_converter_bin terrain.fbx -o terrain
\ No newline at end of file
+fbx_converter_bin terrain.fbx -o terrain
+asset_bake dedup ../data
+asset_bake scene ../data terrain/terrain.dedup.scn terrain/terrain.bscn
+asset_bake height ../data height.raw height.tiles
+rem GAME is the game built without PACKED, it records the menu flood loop to data/flood.loop
+if defined GAME %GAME% -record-flood-loop
+asset_bake pack ../data data.pak